@@ -9,9 +9,88 @@
 
 #include "math.h"
 #include <stdlib.h>    
+#include <vector>
+#include <algorithm>
 #include "Eigen/Dense"
 #include "Eigen/Eigenvalues"
 
+///rows of a tall matrix handled at a time by each thread
+#define RSVD_BLOCK 4096
+///partial sums kept by rsvd_crossprod
+#define RSVD_NPART 64
+
+//out = A^T * B for tall A and B (small results), summed over blocks of rows in parallel.
+//block b goes to partial sum b % RSVD_NPART and these are added in order, so the
+//result does not depend on the number of threads or their timing.
+template<typename MatrixType>
+void rsvd_crossprod(const MatrixType & A,const MatrixType & B,MatrixType & out)
+{
+    int n = A.rows();
+    int nblock = (n + RSVD_BLOCK - 1) / RSVD_BLOCK;
+    int npart = std::min(nblock,RSVD_NPART);
+    std::vector<MatrixType> part(npart,MatrixType::Zero(A.cols(),B.cols()));
+#pragma omp parallel for schedule(dynamic,1)
+    for(int p=0;p<npart;p++)
+    {
+	for(int b=p;b<nblock;b+=npart)
+	{
+	    int r0 = b*RSVD_BLOCK, nr = std::min(RSVD_BLOCK,n-r0);
+	    part[p].noalias() += A.middleRows(r0,nr).transpose() * B.middleRows(r0,nr);
+	}
+    }
+    out = MatrixType::Zero(A.cols(),B.cols());
+    for(int p=0;p<npart;p++)
+    {
+	out += part[p];
+    }
+}
+
+//the matrix RandomSVD decomposes. it is only ever multiplied by, so it can be held
+//in any form that supports the two products (e.g. PackedGenotypeMatrix in pcamatrix.hh)
+template<typename MatrixType>
+class SVDOperator {
+public:
+    virtual ~SVDOperator() {}
+    virtual int rows() const = 0;
+    virtual int cols() const = 0;
+    //out = A * R
+    virtual void multiply(const MatrixType & R,MatrixType & out) const = 0;
+    //out = A^T * Y
+    virtual void transposeMultiply(const MatrixType & Y,MatrixType & out) const = 0;
+};
+
+//a dense matrix as an SVDOperator, holds a reference to mat.
+//the products are split into blocks of samples (A*R) or markers (A^T*Y) across threads.
+template<typename MatrixType>
+class DenseSVDOperator : public SVDOperator<MatrixType> {
+public:
+    DenseSVDOperator(const MatrixType & mat) : _mat(mat) {}
+    int rows() const {return _mat.rows();}
+    int cols() const {return _mat.cols();}
+    void multiply(const MatrixType & R,MatrixType & out) const {
+	int n = _mat.rows();
+	out.resize(n,R.cols());
+#pragma omp parallel for schedule(static)
+	for(int r0=0;r0<n;r0+=RSVD_BLOCK)
+	{
+	    int nr = std::min(RSVD_BLOCK,n-r0);
+	    out.middleRows(r0,nr).noalias() = _mat.middleRows(r0,nr) * R;
+	}
+    }
+    void transposeMultiply(const MatrixType & Y,MatrixType & out) const {
+	int l = _mat.cols();
+	out.resize(l,Y.cols());
+#pragma omp parallel for schedule(static)
+	for(int c0=0;c0<l;c0+=RSVD_BLOCK)
+	{
+	    int nc = std::min(RSVD_BLOCK,l-c0);
+	    out.middleRows(c0,nc).noalias() = _mat.middleCols(c0,nc).transpose() * Y;
+	}
+    }
+private:
+    const MatrixType & _mat;
+};
+
 template<typename MatrixType>    
 class RandomSVD {
     typedef typename MatrixType::Scalar Scalar;
@@ -21,6 +100,32 @@ public:
     //N:nsample L:nsnp e: desired number of PCs
     //mat is an N x L
     RandomSVD(const MatrixType & mat,int e,int q=3)	{
+	DenseSVDOperator<MatrixType> op(mat);
+	compute(op,e,q);
+    }
+
+    RandomSVD(const SVDOperator<MatrixType> & op,int e,int q=3)	{
+	compute(op,e,q);
+    }
+
+    MatrixType matrixU() const{
+	return _U;
+    }
+
+    VectorType singularValues() const {
+	return _S;
+    }
+
+    MatrixType matrixV() const {
+	return _V;
+    }
+    
+private:
+    MatrixType _U;
+    VectorType _S;
+    MatrixType _V;    
+
+    void compute(const SVDOperator<MatrixType> & mat,int e,int q) {
 	int r = e;
 	if(r>mat.rows())
 	{
@@ -33,39 +138,34 @@ public:
 
 	MatrixType R;
 	rnorm(R,mat.cols(),r);//L x e
-	MatrixType Y  = mat * R;//N x e
+	MatrixType Y;
+	mat.multiply(R,Y);//N x e
 	orthonormalize(Y);
 	MatrixType Ystar;
 	for(int i=0;i<q;i++)
 	{
-	    Ystar=mat.transpose() * Y; // L x e
+	    mat.transposeMultiply(Y,Ystar); // L x e
 	    orthonormalize(Ystar);
-	    Y=mat * Ystar;
+	    mat.multiply(Ystar,Y);
 	    orthonormalize(Y);
 	}	    
-	MatrixType B = Y.transpose() * mat;//e x L
-	Eigen::JacobiSVD<MatrixType > svd(B, Eigen::ComputeThinU | Eigen::ComputeThinV);
+	mat.transposeMultiply(Y,Ystar);
+	//B = Y^T * mat = Ystar^T. with Ystar = Q T the SVD of B is that of the small T^T,
+	//its right singular vectors rotated by Q, so the L x e matrix never goes through Jacobi
+	MatrixType Q = Ystar,T;
+	orthonormalize(Q);
+	rsvd_crossprod(Q,Ystar,T);
+	Eigen::JacobiSVD<MatrixType > svd(T.transpose(), Eigen::ComputeThinU | Eigen::ComputeThinV);
 	_U = Y * svd.matrixU(); //N x e matrix 
 	_S = svd.singularValues(); //diagonal e x e matrix
-	_V = svd.matrixV(); //L x e matrix.
-    }
-
-    MatrixType matrixU() const{
-	return _U;
-    }
-
-    VectorType singularValues() const {
-	return _S;
-    }
-
-    MatrixType matrixV() const {
-	return _V;
+	_V.resize(Q.rows(),svd.matrixV().cols()); //L x e matrix.
+#pragma omp parallel for schedule(static)
+	for(int r0=0;r0<Q.rows();r0+=RSVD_BLOCK)
+	{
+	    int nr = std::min(RSVD_BLOCK,(int)Q.rows()-r0);
+	    _V.middleRows(r0,nr).noalias() = Q.middleRows(r0,nr) * svd.matrixV();
+	}
     }
-    
-private:
-    MatrixType _U;
-    VectorType _S;
-    MatrixType _V;    
 
     inline void rnorm(MatrixType & X,int nrow, int ncol) {
 	X.resize(nrow,ncol);
@@ -87,7 +187,38 @@ private:
 	}
     }
 
+    //CholeskyQR2: mat = Q C with C^T C = mat^T mat, so Q = mat C^-1. one pass loses
+    //orthogonality as the condition number grows so it is done twice. the Gram matrix
+    //and the triangular solves are blocked over rows and threaded. falls back to
+    //Householder QR if mat^T mat is not positive definite (mat is rank deficient).
     inline void orthonormalize(MatrixType & mat) {
+	int n = mat.rows();
+	MatrixType input = mat;
+	for(int pass=0;pass<2;pass++)
+	{
+	    MatrixType gram;
+	    rsvd_crossprod(mat,mat,gram);
+	    Eigen::LLT<MatrixType> llt(gram);
+	    if(llt.info()!=Eigen::Success)
+	    {
+		householder(mat);
+		return;
+	    }
+#pragma omp parallel for schedule(static)
+	    for(int r0=0;r0<n;r0+=RSVD_BLOCK)
+	    {
+		int nr = std::min(RSVD_BLOCK,n-r0);
+		llt.matrixU().template solveInPlace<Eigen::OnTheRight>(mat.middleRows(r0,nr));
+	    }
+	}
+	if(!mat.allFinite())//near singular
+	{
+	    mat = input;
+	    householder(mat);
+	}
+    }
+
+    inline void householder(MatrixType & mat) {
 	MatrixType  thinQ;
 	thinQ.setIdentity(mat.rows(), mat.cols());
 	mat = mat.householderQr().householderQ()*thinQ;
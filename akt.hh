@@ -64,7 +64,6 @@ int unrelated_main(int argc,char **argv);
 int r2_main(int argc, char **argv);
 int pedphase_main(int argc, char **argv);
 
-int grm(bcf_srs_t *sr);
 int prune_main(int argc,char **argv);
 
 
@@ -0,0 +1,45 @@
+#!/bin/bash
+##benchmarks akt kin on synthetic cohorts with planted relatives
+##
+##usage: bash bench.sh [results.json]  (relative paths are relative to bench/)
+##  BENCH_SIZES     samples:markers cohorts to run (default "1000:10000 1000:100000 10000:100000")
+##                  the full grid is e.g. "1000:10000 1000:500000 10000:100000 100000:10000 100000:500000"
+##  BENCH_THREADS   threads for akt kin and the generator (default nproc)
+##  BENCH_KIN_ARGS  extra akt kin arguments (default "-k 0.05", the text output of every pair is huge)
+##  BENCH_DIR       where cohorts are generated and kept between runs (default ./data)
+##
+##each cohort gets one JSON object with the stage timings from akt kin --stats-json
+##and the fraction of planted relative pairs found above -k.
+
+set -e
+cd "$(dirname "$0")"
+results=${1:-results.json}
+sizes=${BENCH_SIZES:-"1000:10000 1000:100000 10000:100000"}
+threads=${BENCH_THREADS:-$(nproc)}
+kin_args=${BENCH_KIN_ARGS:-"-k 0.05"}
+dir=${BENCH_DIR:-data}
+mkdir -p $dir
+
+sep=""
+echo "[" > $results
+for size in $sizes
+do
+    n=${size%:*}
+    m=${size#*:}
+    cohort=$dir/cohort_${n}_${m}.bcf
+    if [ ! -f $cohort.csi ]
+    then
+	echo "Simulating $n samples x $m markers"
+	./simulate -n $n -m $m -@ $threads -o $cohort
+    fi
+    echo "akt kin on $n samples x $m markers"
+    ../akt kin --force -@ $threads $kin_args --stats-json $dir/stats.json -o $dir/kin.txt $cohort 2> $dir/kin.log
+    ##planted pairs (expected kinship > 0.2) reported with kinship > 0.1
+    recall=$(awk 'NR==FNR{if($3>0.2){want[$1"\t"$2]=1;n++} next} ($1"\t"$2 in want)&&$6>0.1{found++} END{printf "%.4f",n ? found/n : 1}' $cohort.truth $dir/kin.txt)
+    echo "$sep{\"samples\": $n, \"markers\": $m, \"planted_recall\": $recall, \"kin\": " >> $results
+    cat $dir/stats.json >> $results
+    echo "}" >> $results
+    sep=","
+done
+echo "]" >> $results
+echo "Results written to $results"
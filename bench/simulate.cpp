@@ -0,0 +1,190 @@
+/**
+ * @file   simulate.cpp
+ * @brief  Synthetic cohorts with planted relatives for benchmarking akt kin.
+ *
+ * Writes an indexed BCF of unphased diploid genotypes and a truth file of the
+ * planted pairs. Markers are independent with allele frequencies uniform on
+ * [0.05,0.5]. Families are two founders and two full sib children, each child
+ * inherits a mosaic of its parents' haplotypes (about 30 crossovers per
+ * meiosis). Some unrelated samples are duplicated, everyone else is unrelated.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <iostream>
+#include <fstream>
+#include <random>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include "htslib/vcf.h"
+#include "htslib/hts.h"
+}
+
+using namespace std;
+
+///fraction of samples in families of four
+#define FAMILY_FRACTION 0.1
+///fraction of samples that duplicate another
+#define DUPLICATE_FRACTION 0.01
+///crossovers per meiosis over the whole simulated genome
+#define CROSSOVERS 30
+
+static void usage()
+{
+    cerr << "\nAbout: simulate a cohort with planted relatives" << endl;
+    cerr << "Usage: simulate -n samples -m markers -o out.bcf [-s seed] [-@ threads]" << endl;
+    cerr << "Writes out.bcf, its index and out.bcf.truth (ID1 ID2 KINSHIP RELATIONSHIP)" << endl;
+    exit(1);
+}
+
+static void die(const string & s)
+{
+    cerr << "ERROR: " << s << endl;
+    exit(1);
+}
+
+int main(int argc,char **argv)
+{
+    int nsample=0,nmarker=0,nthreads=1;
+    unsigned seed=1;
+    string output;
+    int c;
+    while((c = getopt(argc,argv,"n:m:o:s:@:")) >= 0)
+    {
+	switch(c)
+	{
+	case 'n': nsample = atoi(optarg); break;
+	case 'm': nmarker = atoi(optarg); break;
+	case 'o': output = optarg; break;
+	case 's': seed = atoi(optarg); break;
+	case '@': nthreads = atoi(optarg); break;
+	default: usage();
+	}
+    }
+    if(nsample<4 || nmarker<1 || output.empty())
+    {
+	usage();
+    }
+
+//sample layout: families [father,mother,child,child], then duplicates of the first unrelated samples, then unrelated
+    int nfamily = (int)(nsample*FAMILY_FRACTION/4);
+    int first_unrelated = 4*nfamily;
+    int nduplicate = min((int)(nsample*DUPLICATE_FRACTION),(nsample-first_unrelated)/2);
+    int first_duplicate = nsample-nduplicate;
+    vector<string> names(nsample);
+    vector<int> source(nsample,-1);///sample duplicated by each duplicate
+    ofstream truth((output+".truth").c_str());
+    for(int i=0; i<nsample; i++)
+    {
+	names[i] = "SIM"+to_string(i);
+    }
+    for(int f=0; f<nfamily; f++)
+    {
+	int i = 4*f;
+	for(int child=i+2; child<i+4; child++)
+	{
+	    truth << names[i] << "\t" << names[child] << "\t0.25\tparent-offspring\n";
+	    truth << names[i+1] << "\t" << names[child] << "\t0.25\tparent-offspring\n";
+	}
+	truth << names[i+2] << "\t" << names[i+3] << "\t0.25\tfull-sibling\n";
+    }
+    for(int d=0; d<nduplicate; d++)
+    {
+	source[first_duplicate+d] = first_unrelated+d;
+	truth << names[first_unrelated+d] << "\t" << names[first_duplicate+d] << "\t0.5\tduplicate\n";
+    }
+    truth.close();
+
+    htsFile *fp = hts_open(output.c_str(),"wb");
+    if(fp==NULL)
+    {
+	die("could not open "+output);
+    }
+    if(nthreads>1)
+    {
+	hts_set_threads(fp,nthreads);
+    }
+    bcf_hdr_t *hdr = bcf_hdr_init("w");
+    bcf_hdr_append(hdr,"##contig=<ID=1,length=249250621>");
+    bcf_hdr_append(hdr,"##FORMAT=<ID=GT,Number=1,Type=String,Description=\"Genotype\">");
+    for(int i=0; i<nsample; i++)
+    {
+	bcf_hdr_add_sample(hdr,names[i].c_str());
+    }
+    bcf_hdr_add_sample(hdr,NULL);
+    if(bcf_hdr_write(fp,hdr)!=0)
+    {
+	die("could not write "+output);
+    }
+
+    mt19937_64 rng(seed);
+    uniform_real_distribution<double> unif(0,1);
+    uniform_real_distribution<double> freq(0.05,0.5);
+    double switch_rate = (double)CROSSOVERS/nmarker;
+//for each child and parent, which of the parent's haplotypes is being copied
+    vector<int> phase(4*nfamily,0);
+    for(size_t k=0; k<phase.size(); k++)
+    {
+	phase[k] = rng()&1;
+    }
+    vector<int8_t> hap(2*nsample);
+    vector<int32_t> gt(2*nsample);
+    bcf1_t *rec = bcf_init();
+    int step = max(1,249000000/nmarker);
+    for(int m=0; m<nmarker; m++)
+    {
+	double p = freq(rng);
+	uint64_t threshold = (uint64_t)(p*18446744073709551615.0);
+	for(int i=0; i<nsample; i++)
+	{
+	    int f = i/4, role = i%4;
+	    if(i<first_unrelated && role>=2)//child
+	    {
+		for(int parent=0; parent<2; parent++)
+		{
+		    int &ph = phase[2*(2*f+role-2)+parent];
+		    if(unif(rng)<switch_rate)
+		    {
+			ph ^= 1;
+		    }
+		    hap[2*i+parent] = hap[2*(4*f+parent)+ph];
+		}
+	    }
+	    else if(source[i]>=0)
+	    {
+		hap[2*i] = hap[2*source[i]];
+		hap[2*i+1] = hap[2*source[i]+1];
+	    }
+	    else
+	    {
+		hap[2*i] = rng()<threshold;
+		hap[2*i+1] = rng()<threshold;
+	    }
+	    gt[2*i] = bcf_gt_unphased(hap[2*i]);
+	    gt[2*i+1] = bcf_gt_unphased(hap[2*i+1]);
+	}
+	bcf_clear(rec);
+	rec->rid = 0;
+	rec->pos = (int64_t)m*step;
+	bcf_update_alleles_str(hdr,rec,"A,G");
+	bcf_update_genotypes(hdr,rec,&gt[0],gt.size());
+	if(bcf_write(fp,hdr,rec)!=0)
+	{
+	    die("problem writing "+output);
+	}
+    }
+    bcf_destroy(rec);
+    bcf_hdr_destroy(hdr);
+    if(hts_close(fp)!=0)
+    {
+	die("problem writing "+output);
+    }
+    if(bcf_index_build(output.c_str(),14)!=0)
+    {
+	die("could not index "+output);
+    }
+    return 0;
+}
@@ -0,0 +1,191 @@
+/**
+ * @file   grm.cpp
+ * @brief  Genetic relationship matrix for akt kin -M 2.
+ *
+ * Dosages are standardised a chunk of markers at a time and multiplied into
+ * the N x N sums tile by tile, so the cost is a cache-blocked SGEMM and memory
+ * stays at N^2 + N x GRM_CHUNK floats.
+ */
+
+#include "grm.hh"
+#include "utils.hh"
+#include "gtdecode.hh"
+
+using namespace std;
+
+Grm::Grm(int nsample)
+{
+    _nsample = nsample;
+    _markers = 0;
+    _grm = Eigen::MatrixXf::Zero(_nsample,_nsample);
+    _z.resize(_nsample,GRM_CHUNK);
+    _called.resize(_nsample,GRM_CHUNK);
+    _diag.assign(_nsample,0);
+    _ncalled.assign(_nsample,0);
+    _nchunk = 0;
+    _chunk_missing = false;
+    _complete = 0;
+}
+
+/**
+ * @name    addMarkers
+ * @brief   standardise a batch of markers into the current chunk
+ *
+ * A genotype g at a marker with frequency p is (g-2p)/sqrt(2p(1-p)), missing
+ * genotypes are 0 so they add nothing to the sums.
+ *
+ * @param [in] codes  	n arrays of _nsample genotypes (0/1/2 or GT_MISSING)
+ * @param [in] ps  	allele frequency of each marker, in (0,1)
+ */
+void Grm::addMarkers(const uint8_t * const *codes,const float *ps,int n)
+{
+    int k0 = 0;
+    while(k0<n)
+    {
+	int len = min(n-k0,GRM_CHUNK-_nchunk);
+	int col = _nchunk;
+	vector<float> mean(len),scale(len),diag_offset(len);
+	for(int k=0; k<len; k++)
+	{
+	    float p = ps[k0+k];
+	    mean[k] = 2*p;
+	    scale[k] = 1/sqrt(2*p*(1-p));
+	    diag_offset[k] = 2*p*p;
+	}
+	bool missing = false;
+#pragma omp parallel for schedule(static) reduction(||:missing) if((size_t)_nsample*len >= 65536)
+	for(int i=0; i<_nsample; i++)
+	{
+	    for(int k=0; k<len; k++)
+	    {
+		int g = codes[k0+k][i];
+		if(g<=2)
+		{
+		    _z(i,col+k) = (g-mean[k])*scale[k];
+		    _called(i,col+k) = 1;
+///GCTA's diagonal, (g^2 - (1+2p)g + 2p^2) / 2p(1-p)
+		    _diag[i] += (g*g - (1+mean[k])*g + diag_offset[k])*scale[k]*scale[k];
+		    _ncalled[i]++;
+		}
+		else
+		{
+		    _z(i,col+k) = 0;
+		    _called(i,col+k) = 0;
+		    missing = true;
+		}
+	    }
+	}
+	_chunk_missing = _chunk_missing || missing;
+	_nchunk += len;
+	_markers += len;
+	k0 += len;
+	if(_nchunk == GRM_CHUNK)
+	{
+	    flush();
+	}
+    }
+}
+
+///multiplies the current chunk into the lower (sums) and strict upper (called counts) triangles
+void Grm::flush()
+{
+    if(_nchunk == 0)
+    {
+	return;
+    }
+    vector< pair<int,int> > tiles;
+    for(int ti=0; ti<_nsample; ti+=GRM_TILE)
+    {
+	for(int tj=0; tj<=ti; tj+=GRM_TILE)
+	{
+	    tiles.push_back(make_pair(ti,tj));
+	}
+    }
+    bool count_called = _chunk_missing;
+#pragma omp parallel for schedule(dynamic,1)
+    for(size_t t=0; t<tiles.size(); t++)
+    {
+	int ti = tiles[t].first, tj = tiles[t].second;
+	int ni = min(GRM_TILE,_nsample-ti), nj = min(GRM_TILE,_nsample-tj);
+	Eigen::Block<Eigen::MatrixXf> zi = _z.block(ti,0,ni,_nchunk), zj = _z.block(tj,0,nj,_nchunk);
+	Eigen::Block<Eigen::MatrixXf> ci = _called.block(ti,0,ni,_nchunk), cj = _called.block(tj,0,nj,_nchunk);
+	if(ti != tj)
+	{
+	    _grm.block(ti,tj,ni,nj).noalias() += zi * zj.transpose();
+	    if(count_called)
+	    {
+		_grm.block(tj,ti,nj,ni).noalias() += cj * ci.transpose();
+	    }
+	}
+	else//the diagonal tile holds both triangles
+	{
+	    Eigen::MatrixXf prod(ni,ni);
+	    prod.noalias() = zi * zi.transpose();
+	    _grm.block(ti,ti,ni,ni).triangularView<Eigen::StrictlyLower>() += prod;
+	    if(count_called)
+	    {
+		prod.noalias() = ci * ci.transpose();
+		_grm.block(ti,ti,ni,ni).triangularView<Eigen::StrictlyUpper>() += prod;
+	    }
+	}
+    }
+    if(!count_called)
+    {
+	_complete += _nchunk;
+    }
+    _nchunk = 0;
+    _chunk_missing = false;
+}
+
+void Grm::finish()
+{
+    flush();
+}
+
+static void write_floats(FILE *fp,const vector<float> & v,const string & filename)
+{
+    if(!v.empty() && fwrite(&v[0],sizeof(float),v.size(),fp)!=v.size())
+    {
+	die("problem writing "+filename);
+    }
+}
+
+/**
+ * @name    write
+ * @brief   write the GRM as GCTA's binary triangle
+ *
+ * .grm.bin and .grm.N.bin hold the lower triangle (diagonal included) row by
+ * row as float32, .grm.id the sample names as FID and IID.
+ */
+void Grm::write(const string & prefix,const vector<string> & names) const
+{
+    assert((int)names.size()==_nsample);
+    string grm_name = prefix+".grm.bin", n_name = prefix+".grm.N.bin", id_name = prefix+".grm.id";
+    FILE *grm_fp = fopen(grm_name.c_str(),"wb");
+    FILE *n_fp = fopen(n_name.c_str(),"wb");
+    FILE *id_fp = fopen(id_name.c_str(),"w");
+    if(grm_fp==NULL || n_fp==NULL || id_fp==NULL)
+    {
+	die("could not open "+prefix+".grm.* for writing");
+    }
+    vector<float> grm_row,n_row;
+    for(int i=0; i<_nsample; i++)
+    {
+	grm_row.resize(i+1);
+	n_row.resize(i+1);
+	for(int j=0; j<i; j++)
+	{
+	    n_row[j] = _grm(j,i) + _complete;
+	    grm_row[j] = _grm(i,j) / n_row[j];
+	}
+	n_row[i] = _ncalled[i];
+	grm_row[i] = 1 + _diag[i]/_ncalled[i];
+	write_floats(grm_fp,grm_row,grm_name);
+	write_floats(n_fp,n_row,n_name);
+	fprintf(id_fp,"%s\t%s\n",names[i].c_str(),names[i].c_str());
+    }
+    if(fclose(grm_fp)!=0 || fclose(n_fp)!=0 || fclose(id_fp)!=0)
+    {
+	die("problem writing "+prefix+".grm.*");
+    }
+}
@@ -0,0 +1,42 @@
+#ifndef AKT_GRM_H
+#define AKT_GRM_H
+
+#include "akt.hh"
+#include "Eigen/Dense"
+
+///markers standardised and multiplied in at a time
+#define GRM_CHUNK 1024
+///samples per side of a tile of the product, tiles are shared between threads
+#define GRM_TILE 256
+
+//genetic relationship matrix (GCTA's estimator) accumulated as a blocked
+//single precision product over chunks of standardised dosages.
+//
+//memory is one N x N matrix plus one N x GRM_CHUNK chunk: the GRM sums are held
+//in the lower triangle and the counts of markers called in both samples in the
+//strict upper triangle.
+class Grm
+{
+public:
+    Grm(int nsample);
+    //appends n markers given as arrays of nsample genotypes from decode_gt (0/1/2 or GT_MISSING)
+    void addMarkers(const uint8_t * const *codes,const float *ps,int n);
+    //multiplies in the markers still buffered, call before write()
+    void finish();
+    //writes prefix.grm.bin, prefix.grm.N.bin and prefix.grm.id in GCTA's binary format
+    void write(const string & prefix,const vector<string> & names) const;
+    int markers() const {return _markers;};
+private:
+    void flush();
+    int _nsample,_markers;
+    Eigen::MatrixXf _grm; ///lower: sums of z_i*z_j, strict upper: markers called in both
+    Eigen::MatrixXf _z; ///standardised dosages of the current chunk, missing are 0
+    Eigen::MatrixXf _called; ///1 if called, only multiplied in for chunks with missing genotypes
+    vector<double> _diag; ///sums of the GCTA diagonal term
+    vector<int> _ncalled; ///markers called per sample
+    int _nchunk; ///markers in the current chunk
+    bool _chunk_missing; ///the current chunk has a missing genotype
+    int _complete; ///markers in chunks without missing genotypes, called in every pair
+};
+
+#endif //AKT_GRM_H
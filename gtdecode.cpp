@@ -0,0 +1,67 @@
+/**
+ * @file   gtdecode.cpp
+ * @brief  Decoding of diploid genotypes from the raw BCF2 GT field.
+ *
+ * GT values are (allele+1)<<1|phased, so allele = (v>>1)-1 for every integer
+ * width. missing alleles decode to -1 and the type's missing/vector_end
+ * sentinels to large negative numbers, so a single sign test finds both.
+ */
+
+#include "gtdecode.hh"
+
+///one record of n values per sample with integer type T
+template<typename T>
+static void decode_gt_type(const uint8_t *p,int nsample,int n,uint8_t *codes,GtCounts & counts)
+{
+    const T *v = (const T *)p;
+    const T vector_end = sizeof(T)==1 ? bcf_int8_vector_end : sizeof(T)==2 ? bcf_int16_vector_end : bcf_int32_vector_end;
+    int ac=0,an=0,nhaploid=0;
+    if(n==2)
+    {
+#pragma omp simd reduction(+:ac,an,nhaploid)
+	for(int i=0; i<nsample; i++)
+	{
+	    int a = (v[2*i]>>1)-1, b = (v[2*i+1]>>1)-1;
+	    int oka = a>=0, okb = b>=0;
+	    ac += (oka ? a : 0) + (okb ? b : 0);
+	    an += oka + okb;
+	    nhaploid += v[2*i+1]==vector_end;
+	    codes[i] = oka && okb ? (uint8_t)(a+b) : GT_MISSING;
+	}
+    }
+    else//haploid (n==1) records
+    {
+	for(int i=0; i<nsample; i++)
+	{
+	    int a = (v[i*n]>>1)-1;
+	    if(a>=0)
+	    {
+		ac += a;
+		an++;
+	    }
+	    nhaploid++;
+	    codes[i] = GT_MISSING;
+	}
+    }
+    counts.ac = ac;
+    counts.an = an;
+    counts.nhaploid = nhaploid;
+}
+
+int decode_gt(const bcf_hdr_t *hdr,bcf1_t *line,uint8_t *codes,GtCounts & counts)
+{
+    bcf_fmt_t *fmt = bcf_get_fmt(hdr,line,"GT");
+    if(fmt==NULL || fmt->n<1 || fmt->n>2)
+    {
+	return -1;
+    }
+    int nsample = bcf_hdr_nsamples(hdr);
+    switch(fmt->type)
+    {
+    case BCF_BT_INT8: decode_gt_type<int8_t>(fmt->p,nsample,fmt->n,codes,counts); break;
+    case BCF_BT_INT16: decode_gt_type<int16_t>(fmt->p,nsample,fmt->n,codes,counts); break;
+    case BCF_BT_INT32: decode_gt_type<int32_t>(fmt->p,nsample,fmt->n,codes,counts); break;
+    default: return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,23 @@
+#ifndef AKT_GTDECODE_H
+#define AKT_GTDECODE_H
+
+#include "akt.hh"
+
+///code for a genotype with a missing allele
+#define GT_MISSING 255
+
+///allele totals of one record from decode_gt
+struct GtCounts
+{
+    int ac;      ///sum of the non-missing allele indices (alt allele count for bi-allelic sites)
+    int an;      ///number of non-missing alleles
+    int nhaploid;///samples with fewer than two alleles (padded with vector_end)
+};
+
+//decodes FORMAT/GT straight from the record's typed BCF2 buffer (so without
+//the 2N int32 copy bcf_get_genotypes makes) into one code per sample: the sum
+//of the two allele indices, or GT_MISSING if either allele is missing.
+//returns 0, or -1 if the record has no GT or a sample has more than two alleles.
+int decode_gt(const bcf_hdr_t *hdr,bcf1_t *line,uint8_t *codes,GtCounts & counts);
+
+#endif //AKT_GTDECODE_H
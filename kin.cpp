@@ -9,6 +9,13 @@
 
 #include "kin.hh" 
 
+#include <fcntl.h>
+#include <unistd.h>
+#include <set>
+#include <unordered_map>
+#include <random>
+#include <numeric>
+
 using namespace std;
 
 /**
@@ -25,17 +32,28 @@ void read_pairs(ifstream &in, vector< pair<string, string> > &relpairs, map<stri
 	
     if(!in.is_open())
     {
-	cout << "Failed to open file." << endl;
-	exit(1);
+	die("failed to open the pair file");
     }
     
     string line = ""; 	
+    int nline = 0;
     while(getline(in,line)) // loop through the file
     {
+	nline++;
 	stringstream is(line);
 	istream_iterator<string> begin(is);
 	istream_iterator<string> end;
 	vector<string> tokens(begin, end);
+	if(tokens.empty())
+	{
+	    continue;
+	}
+	if(tokens.size() < 2)
+	{
+	    stringstream ss;
+	    ss << "line " << nline << " of the pair file has fewer than two sample names";
+	    die(ss.str());
+	}
       
 	if ( name_to_id.find(tokens[0]) == name_to_id.end() ) 
 	{
@@ -87,14 +105,30 @@ static void usage()
     cerr << "\t -k --minkin:			threshold for relatedness output (none)" << endl;
     cerr << "\t -F --freq-file:                a file containing population allele frequencies to use in kinship calculation"<<endl;
     cerr << "\t -M --method:			type of estimator. 0:plink (default) 1:king-robust 2:genetic-relationship-matrix" << endl;
+    cerr << "\t    --pairwise-missing:		normalise each pair over the markers called in both samples (sparse/exome data)" << endl;
+    umessage('f');
     umessage('a');
     umessage('@');
+    cerr << "\t				(BGZF decompression threads only when reading the whole file, not with -r/-R/-F)" << endl;
     cerr << "\nSite filtering options:"<<endl;  
     umessage('R');
     umessage('r');
     umessage('T');
     umessage('t');
     cerr << "\t    --force:			run kin without -R/-T/-F" << endl;
+    cerr << "\nOutput options:"<<endl;
+    cerr << "\t -o --output:			output file (default stdout, required for binary output and is the file prefix for -M 2)" << endl;
+    cerr << "\t -O --output-type:		t: text (default) b: binary float32 h: binary float16 g: sparse graph of the pairs above -k" << endl;
+    cerr << "\t    --ordered:			sort output by sample order (deterministic but buffers more output)" << endl;
+    cerr << "\t    --stats-json:		write the time spent in each stage and throughput to this JSON file" << endl;
+    cerr << "\nMemory options:"<<endl;
+    cerr << "\t    --memory:			approximate memory cap in MB, genotypes are kept in a temporary file (out-of-core)" << endl;
+    cerr << "\t    --tmpdir:			directory for the temporary file (default $TMPDIR or /tmp)" << endl;
+    cerr << "\t    --sketch:			screen pairs on this fraction of the markers first, only pairs that may exceed -k are fully computed" << endl;
+    cerr << "\t    --sketch-z:			standard errors added to the screening estimate (default 6), pairs just above -k can still be missed" << endl;
+    cerr << "\nIncremental options:"<<endl;
+    cerr << "\t    --save-state:		save the genotypes and -F frequencies so samples can be added later (requires -F)" << endl;
+    cerr << "\t    --load-state:		add the samples in <in.bcf> to a saved state, only pairs with a new sample are output" << endl;
     cerr << "\nSample filtering options:"<<endl;
     umessage('s');
     umessage('S');
@@ -102,7 +136,8 @@ static void usage()
     exit(1);
 }
 
-void Kinship::addGenotypes(int *gt_arr,float p)
+///adds the expected IBS counts of one marker with allele frequency p
+void Kinship::addMoments(float p)
 {
     float q = 1-p;
     _n00 += 2*p*p*q*q;
@@ -113,29 +148,396 @@ void Kinship::addGenotypes(int *gt_arr,float p)
     _n20 += p*p*p*p + q*q*q*q + 4*q*q*p*p; ///pppp + qqqq + 4ppqq 
     _n21 += p*p + q*q; ///ppp + qqq + ppq + pqq = pp(p+q) + qq(q+p) = pp + qq
     _n22 += 1;
-    _af.push_back(p);    
+}
+
+void Kinship::addGenotypes(int *gt_arr,float p)
+{
+    int ac=0,an=0;
+    vector<uint8_t> codes(_nsample);
+    for(int i=0; i<_nsample; i++)
+    {
+	for(int k=2*i; k<2*i+2; k++)
+	{
+	    if(gt_arr[k] != -1)
+	    {
+		ac += bcf_gt_allele(gt_arr[k]);
+		an++;
+	    }
+	}
+	codes[i] = gt_arr[2*i] != -1 && gt_arr[2*i+1] != -1 ? bcf_gt_allele(gt_arr[2*i]) + bcf_gt_allele(gt_arr[2*i+1]) : GT_MISSING;
+    }
+    const uint8_t *code_ptr = &codes[0];
+    addGenotypes(&code_ptr,&p,&ac,&an,1);
+}
+
+/**
+ * @name    addGenotypes
+ * @brief   append a batch of markers
+ *
+ * The bit-planes are filled in parallel over samples, each thread owning whole
+ * rows, one run of markers within a block at a time.
+ *
+ * @param [in] codes  	n arrays of _nsample genotypes as from decode_gt (0/1/2 or GT_MISSING)
+ * @param [in] ps  	allele frequency of each marker
+ * @param [in] ac,an  	alternate and called allele counts of each marker
+ */
+void Kinship::addGenotypes(const uint8_t * const *codes,const float *ps,const int *ac,const int *an,int n)
+{
+    for(int k=0; k<n; k++)
+    {
+	addMoments(ps[k]);
+	_af.push_back(ps[k]);
+	_ac.push_back(ac[k]);
+	_an.push_back(an[k]);
+    }
 
 ///for each site record truth table
 ///g=0  g=1  g=2  g=missing
-    for(int i=0; i<_nsample; ++i)
-    { 
+    int k0 = 0;
+    while(k0<n)
+    {
 	if(_bc == 0)
 	{ 
-	    _bits[i].push_back( vector< bitset<BITSET_SIZE> >(4, bitset<BITSET_SIZE>() ) ); 
+	    addBlock();
+	}
+	int len = min(n-k0,BITSET_SIZE-_bc);
+	int bc = _bc;
+	size_t offset = (size_t)(residentBlocks()-1)*BLOCK_STRIDE;
+#pragma omp parallel for schedule(static) if((size_t)_nsample*len >= 65536)
+	for(int i=0; i<_nsample; ++i)
+	{ 
+	    uint64_t *block = _bits + i*_stride + offset;
+	    for(int k=0; k<len; k++)
+	    {
+		int g = codes[k0+k][i];
+		block[(g<=2 ? g : 3)*BLOCK_WORDS + (bc+k)/64] |= 1ULL << ((bc+k)%64);
+		_nhet[i] += g==1;
+	    }
 	}
-	if(gt_arr[2*i] != -1 && gt_arr[2*i+1] != -1)
+///chunks of size L
+	_bc = (_bc+len)%(BITSET_SIZE);
+	_markers += len;
+	k0 += len;
+    }
+}
+
+///appends an empty block to every sample row, doubling the row capacity when full
+///(or writing the chunk out when spilling to disk)
+void Kinship::addBlock()
+{
+    int used = residentBlocks();
+    if(used == _capacity && spilled())
+    {
+	writeChunk();
+	used = 0;
+    }
+    else if(used == _capacity)
+    {
+	int capacity = _capacity>0 ? 2*_capacity : 16;
+	size_t stride = (size_t)capacity*BLOCK_STRIDE;
+	uint64_t *bits=NULL;
+	if(posix_memalign((void **)&bits, 64, _nsample*stride*sizeof(uint64_t))!=0)
+	{
+	    die("could not allocate memory for "+to_string(_nsample)+" samples x "+to_string(capacity*BITSET_SIZE)+" markers");
+	}
+	for(int i=0; i<_nsample; ++i)
+	{
+	    memcpy(bits + i*stride, _bits + i*_stride, _nblock*BLOCK_STRIDE*sizeof(uint64_t));
+	}
+	free(_bits);
+	_bits = bits;
+	_stride = stride;
+	_capacity = capacity;
+    }
+    for(int i=0; i<_nsample; ++i)
+    {
+	memset(_bits + i*_stride + (size_t)used*BLOCK_STRIDE, 0, BLOCK_STRIDE*sizeof(uint64_t));
+    }
+    ++_nblock;
+}
+
+/**
+ * @name    enableSpill
+ * @brief   keep genotypes in a temporary file rather than in memory
+ *
+ * Must be called before any genotypes are added. Genotypes are buffered in
+ * chunks of blocks sized to a quarter of max_bytes and written out as each fills.
+ *
+ * @param [in] tmpdir  	directory for the (immediately unlinked) temporary file
+ * @param [in] max_bytes 	memory budget
+ */
+void Kinship::enableSpill(const string & tmpdir,size_t max_bytes)
+{
+    assert(_nblock==0);
+    string name = tmpdir + "/akt_kin.XXXXXX";
+    vector<char> tmp(name.begin(),name.end());
+    tmp.push_back(0);
+    _spill_fd = mkstemp(&tmp[0]);
+    if(_spill_fd<0)
+    {
+	die("could not create a temporary file in "+tmpdir);
+    }
+    unlink(&tmp[0]);
+    size_t row_bytes = (size_t)_nsample*BLOCK_STRIDE*sizeof(uint64_t);
+    _chunk_blocks = max((size_t)1,min((size_t)4*TILE_BLOCKS,max_bytes/4/row_bytes));
+    _capacity = _chunk_blocks;
+    _stride = (size_t)_chunk_blocks*BLOCK_STRIDE;
+    if(posix_memalign((void **)&_bits, 64, _nsample*_stride*sizeof(uint64_t))!=0)
+    {
+	die("could not allocate memory for "+to_string(_nsample)+" samples x "+to_string(_chunk_blocks*BITSET_SIZE)+" markers");
+    }
+}
+
+///writes the resident chunk to the spill file
+void Kinship::writeChunk()
+{
+    size_t bytes = _nsample*_stride*sizeof(uint64_t);
+    const char *p = (const char *)_bits;
+    off_t offset = (off_t)_nchunk*bytes;
+    while(bytes>0)
+    {
+	ssize_t n = pwrite(_spill_fd,p,bytes,offset);
+	if(n<=0)
 	{
-	    int g = bcf_gt_allele(gt_arr[2*i]) + bcf_gt_allele(gt_arr[2*i+1]);
-	    _bits[i].back()[ g ][_bc] = 1;
+	    die("problem writing kinship temporary file (out of disk space?)");
+	}
+	p += n;
+	offset += n;
+	bytes -= n;
+    }
+    _nchunk++;
+}
+
+///flushes the final partial chunk and releases the resident buffer
+void Kinship::finishSpill()
+{
+    if(residentBlocks()>0)
+    {
+	writeChunk();
+    }
+    free(_bits);
+    _bits = NULL;
+}
+
+///reads rows [s0,s1) of chunk k into dst (row stride _stride)
+void Kinship::readChunk(int k,int s0,int s1,uint64_t *dst) const
+{
+    size_t bytes = (s1-s0)*_stride*sizeof(uint64_t);
+    char *p = (char *)dst;
+    off_t offset = (off_t)k*_nsample*_stride*sizeof(uint64_t) + (off_t)s0*_stride*sizeof(uint64_t);
+    while(bytes>0)
+    {
+	ssize_t n = pread(_spill_fd,p,bytes,offset);
+	if(n<=0)
+	{
+	    die("problem reading kinship temporary file");
+	}
+	p += n;
+	offset += n;
+	bytes -= n;
+    }
+}
+
+///state file magic, see saveState
+#define KIN_STATE_MAGIC "AKTKST01"
+
+static void write_state(FILE *fp,const void *p,size_t n)
+{
+    if(n>0 && fwrite(p,1,n,fp)!=n)
+    {
+	die("problem writing kinship state file (out of disk space?)");
+    }
+}
+
+static void read_state(FILE *fp,void *p,size_t n)
+{
+    if(n>0 && fread(p,1,n,fp)!=n)
+    {
+	die("kinship state file is truncated or corrupt");
+    }
+}
+
+static void write_state_string(FILE *fp,const string & s)
+{
+    uint32_t n = s.size();
+    write_state(fp,&n,4);
+    write_state(fp,s.data(),n);
+}
+
+static string read_state_string(FILE *fp)
+{
+    uint32_t n;
+    read_state(fp,&n,4);
+    string s(n,'\0');
+    read_state(fp,&s[0],n);
+    return s;
+}
+
+/**
+ * @name    saveState
+ * @brief   write the genotype store and per-marker frequency sums to a file
+ *
+ * The state is what a later run needs to add samples without re-reading this
+ * cohort: sample names, a key per marker (see kin_site_key), the frequencies
+ * and allele counts, then every sample's packed genotype row.
+ *
+ * @param [in] names  	sample names in row order
+ * @param [in] sites  	marker keys in marker order
+ * @param [in] fixed_af  	frequencies came from -F and must not be re-estimated
+ */
+void Kinship::saveState(const string & filename,const vector<string> & names,const vector<string> & sites,bool fixed_af) const
+{
+    assert(!spilled() && (int)names.size()==_nsample && (int)sites.size()==_markers);
+    FILE *fp = fopen(filename.c_str(),"wb");
+    if(fp==NULL)
+    {
+	die("could not open "+filename+" for writing");
+    }
+    int32_t header[4] = {_nsample,_markers,_nblock,fixed_af};
+    write_state(fp,KIN_STATE_MAGIC,8);
+    write_state(fp,header,sizeof(header));
+    for(int i=0; i<_nsample; i++)
+    {
+	write_state_string(fp,names[i]);
+    }
+    for(int m=0; m<_markers; m++)
+    {
+	write_state_string(fp,sites[m]);
+    }
+    write_state(fp,&_af[0],_markers*sizeof(float));
+    write_state(fp,&_ac[0],_markers*sizeof(int));
+    write_state(fp,&_an[0],_markers*sizeof(int));
+    for(int i=0; i<_nsample; i++)
+    {
+	write_state(fp,row(i),(size_t)_nblock*BLOCK_STRIDE*sizeof(uint64_t));
+    }
+    if(fclose(fp)!=0)
+    {
+	die("problem writing "+filename);
+    }
+}
+
+/**
+ * @name    loadState
+ * @brief   prepend the samples of a saved state to an empty Kinship
+ *
+ * The samples this object was constructed with follow the saved ones and start
+ * out missing at every saved marker, setGenotypes() then fills them in.
+ *
+ * @param [out] names  	names of the saved samples
+ * @param [out] sites  	saved marker keys
+ * @param [out] fixed_af  	true if the saved frequencies came from -F
+ * @return number of saved samples
+ */
+int Kinship::loadState(const string & filename,vector<string> & names,vector<string> & sites,bool & fixed_af)
+{
+    assert(_nblock==0 && !spilled());
+    FILE *fp = fopen(filename.c_str(),"rb");
+    if(fp==NULL)
+    {
+	die("could not open "+filename);
+    }
+    char magic[8];
+    read_state(fp,magic,8);
+    if(memcmp(magic,KIN_STATE_MAGIC,8)!=0)
+    {
+	die(filename+" is not an akt kin state file");
+    }
+    int32_t header[4];
+    read_state(fp,header,sizeof(header));
+    int nold = header[0];
+    _markers = header[1];
+    int nblock = header[2];
+    fixed_af = header[3]!=0;
+    if(nold<0 || _markers<0 || nblock != (_markers+BITSET_SIZE-1)/BITSET_SIZE)
+    {
+	die(filename+" is truncated or corrupt");
+    }
+    names.resize(nold);
+    for(int i=0; i<nold; i++)
+    {
+	names[i] = read_state_string(fp);
+    }
+    sites.resize(_markers);
+    for(int m=0; m<_markers; m++)
+    {
+	sites[m] = read_state_string(fp);
+    }
+    _af.resize(_markers);
+    _ac.resize(_markers);
+    _an.resize(_markers);
+    read_state(fp,&_af[0],_markers*sizeof(float));
+    read_state(fp,&_ac[0],_markers*sizeof(int));
+    read_state(fp,&_an[0],_markers*sizeof(int));
+
+    int nnew = _nsample;
+    _nsample = nold + nnew;
+    _capacity = max(nblock,1);
+    _stride = (size_t)_capacity*BLOCK_STRIDE;
+    if(posix_memalign((void **)&_bits, 64, _nsample*_stride*sizeof(uint64_t))!=0)
+    {
+	die("could not allocate memory for "+to_string(_nsample)+" samples x "+to_string(_markers)+" markers");
+    }
+    memset(_bits,0,_nsample*_stride*sizeof(uint64_t));
+    for(int i=0; i<nold; i++)
+    {
+	read_state(fp,_bits + i*_stride,(size_t)nblock*BLOCK_STRIDE*sizeof(uint64_t));
+    }
+    fclose(fp);
+    _nblock = nblock;
+    _bc = _markers%BITSET_SIZE;
+    countHets();
+    for(int i=nold; i<_nsample; i++)
+    {
+	for(int m=0; m<_markers; m++)
+	{
+	    _bits[i*_stride + (size_t)(m/BITSET_SIZE)*BLOCK_STRIDE + 3*BLOCK_WORDS + (m%BITSET_SIZE)/64] |= 1ULL << (m%64);
+	}
+    }
+    return nold;
+}
+
+/**
+ * @name    setGenotypes
+ * @brief   set the genotypes of samples [first,_nsample) at an existing marker
+ *
+ * Used after loadState(), the samples must still be missing at this marker.
+ *
+ * @param [in] codes  	_nsample-first genotypes as in addGenotypes
+ * @param [in] counts  	their allele totals
+ */
+void Kinship::setGenotypes(int marker,int first,const uint8_t *codes,const GtCounts & counts)
+{
+    assert(marker>=0 && marker<_markers);
+    size_t offset = (size_t)(marker/BITSET_SIZE)*BLOCK_STRIDE + (marker%BITSET_SIZE)/64;
+    uint64_t bit = 1ULL << (marker%64);
+    for(int i=first; i<_nsample; ++i)
+    { 
+	int g = codes[i-first];
+	if(g<=2)
+	{
+	    uint64_t *block = _bits + i*_stride + offset;
+	    block[3*BLOCK_WORDS] &= ~bit;
+	    block[g*BLOCK_WORDS] |= bit;
+	    _nhet[i] += g==1;
 	} 
-	else 
+    }
+    _ac[marker] += counts.ac;
+    _an[marker] += counts.an;
+}
+
+///re-estimates the frequencies from the allele counts (unless they are fixed) and recomputes the moments
+void Kinship::updateFrequencies(bool fixed_af)
+{
+    _n00=_n10=_n11=_n20=_n21=_n22=0;
+    for(int m=0; m<_markers; m++)
+    {
+	if(!fixed_af)
 	{
-	    _bits[i].back()[ 3 ][_bc] = 1;
+	    _af[m] = (float)_ac[m] / (float)_an[m];
 	}
+	addMoments(_af[m]);
     }
-///chunks of size L
-    _bc = (_bc+1)%(BITSET_SIZE);
-    ++_markers;
 }
 
 Kinship::Kinship(int nsample)
@@ -148,71 +550,362 @@ Kinship::Kinship(int nsample)
 
     _nsample=nsample;
     _markers=0;
-    _bits.assign(_nsample, vector< vector< bitset<BITSET_SIZE> > >() );
+    _bits=NULL;
+    _stride=0;
+    _nblock=0;
+    _capacity=0;
+    _spill_fd=-1;
+    _chunk_blocks=0;
+    _nchunk=0;
+    _count = select_pair_counter();
+    _pairwise_missing = false;
+    _nhet.assign(_nsample,0);
     _n00=0;
     _n10=0;
     _n11=0;
     _n20=0;
     _n21=0;
     _n22=0;
-    _af.resize(50000);//shouldnt need more markers than this.
     _bc = 0;
 }
 
-
+/**
+ * @name    Kinship
+ * @brief   copy of a subset of another Kinship's marker blocks
+ *
+ * The moments are summed over the markers in the chosen blocks only, so
+ * estimates from the copy are what the full data would give on those markers.
+ *
+ * @param [in] src  	in-memory Kinship to copy from
+ * @param [in] blocks  	indices of the blocks to keep
+ */
+Kinship::Kinship(const Kinship & src,const vector<int> & blocks)
+{
+    assert(!src.spilled());
+    _nsample=src._nsample;
+    _markers=0;
+    _nblock=blocks.size();
+    _capacity=_nblock;
+    _stride=(size_t)_nblock*BLOCK_STRIDE;
+    _spill_fd=-1;
+    _chunk_blocks=0;
+    _nchunk=0;
+    _count = src._count;
+    _n00=_n10=_n11=_n20=_n21=_n22=0;
+    _bc = 0;
+    _bits=NULL;
+    if(posix_memalign((void **)&_bits, 64, max((size_t)1,_nsample*_stride)*sizeof(uint64_t))!=0)
+    {
+	die("could not allocate memory for "+to_string(_nsample)+" samples x "+to_string(_nblock*BITSET_SIZE)+" markers");
+    }
+    for(int i=0; i<_nsample; i++)
+    {
+	for(int b=0; b<_nblock; b++)
+	{
+	    memcpy(_bits + i*_stride + (size_t)b*BLOCK_STRIDE, src.row(i) + (size_t)blocks[b]*BLOCK_STRIDE, BLOCK_STRIDE*sizeof(uint64_t));
+	}
+    }
+    for(int b=0; b<_nblock; b++)
+    {
+	for(int m=blocks[b]*BITSET_SIZE; m<min((blocks[b]+1)*BITSET_SIZE,src._markers); m++)
+	{
+	    addMoments(src._af[m]);
+	    _af.push_back(src._af[m]);
+	    ++_markers;
+	}
+    }
+    countHets();
+    _pairwise_missing = src._pairwise_missing;
+    if(_pairwise_missing)
+    {
+	prepareMissing();
+    }
+}
+
+///recounts the heterozygotes of every sample from the genotype rows
+void Kinship::countHets()
+{
+    _nhet.assign(_nsample,0);
+    for(int i=0; i<_nsample; i++)
+    {
+	const uint64_t *a = row(i);
+	for(int b=0; b<_nblock; b++)
+	{
+	    for(int w=0; w<BLOCK_WORDS; ++w)
+	    {
+		_nhet[i] += __builtin_popcountll(a[(size_t)b*BLOCK_STRIDE + BLOCK_WORDS + w]);
+	    }
+	}
+    }
+}
+
+///method 1 (KING) needs the shared heterozygotes counted in the popcount pass,
+///and with pairwise missingness the heterozygotes opposite a missing genotype
+void Kinship::setMethod(int method,bool pairwise_missing)
+{
+    _pairwise_missing = pairwise_missing;
+    _count = select_pair_counter(method!=1 ? COUNT_IBS : (pairwise_missing ? COUNT_HETMISS : COUNT_HETHET));
+}
+
+/**
+ * @name    prepareMissing
+ * @brief   precompute the moment sums used by pairMoments
+ *
+ * Must be called once all genotypes and frequencies are final.
+ */
+void Kinship::prepareMissing()
+{
+    assert(!spilled());
+    _marker_moments.assign(5*(size_t)_markers,0);
+    _word_moments.assign(5*(size_t)_nblock*BLOCK_WORDS,0);
+    for(int m=0; m<_markers; m++)
+    {
+	float p = _af[m], q = 1-p;
+	float *mm = &_marker_moments[5*(size_t)m];
+	mm[0] = 2*p*p*q*q;
+	mm[1] = 4*p*q*(p*p + q*q);
+	mm[2] = 2*p*q;
+	mm[3] = p*p*p*p + q*q*q*q + 4*q*q*p*p;
+	mm[4] = p*p + q*q;
+	for(int k=0; k<5; k++)
+	{
+	    _word_moments[5*(size_t)(m/64)+k] += mm[k];
+	}
+    }
+    _miss_moments.assign(5*(size_t)_nsample,0);
+    _nmiss.assign(_nsample,0);
+#pragma omp parallel for schedule(static)
+    for(int i=0; i<_nsample; i++)
+    {
+	const uint64_t *a = row(i) + 3*BLOCK_WORDS;
+	double *mi = &_miss_moments[5*(size_t)i];
+	for(int b=0; b<_nblock; b++)
+	{
+	    for(int w=0; w<BLOCK_WORDS; w++)
+	    {
+		uint64_t x = a[(size_t)b*BLOCK_STRIDE + w];
+		_nmiss[i] += __builtin_popcountll(x);
+		for(; x; x &= x-1)
+		{
+		    const float *mm = &_marker_moments[5*(((size_t)b*BLOCK_WORDS + w)*64 + __builtin_ctzll(x))];
+		    for(int k=0; k<5; k++)
+		    {
+			mi[k] += mm[k];
+		    }
+		}
+	    }
+	}
+    }
+}
+
+/**
+ * @name    pairMoments
+ * @brief   expected IBS moments over the markers called in both samples
+ *
+ * The moments of the markers missing in either sample are the two samples'
+ * missing sums less the markers missing in both. Only words where both are
+ * missing are visited, a fully missing word is taken from _word_moments.
+ *
+ * @param [out] n  	n00,n10,n11,n20,n21,n22
+ */
+void Kinship::pairMoments(int j1,int j2,const PairCounts & counts,float *n) const
+{
+    double m[5];
+    for(int k=0; k<5; k++)
+    {
+	m[k] = _miss_moments[5*(size_t)j1+k] + _miss_moments[5*(size_t)j2+k];
+    }
+    if(_nmiss[j1]>0 && _nmiss[j2]>0)
+    {
+	const uint64_t *a = row(j1) + 3*BLOCK_WORDS, *b = row(j2) + 3*BLOCK_WORDS;
+	for(int blk=0; blk<_nblock; blk++)
+	{
+	    for(int w=0; w<BLOCK_WORDS; w++)
+	    {
+		size_t offset = (size_t)blk*BLOCK_STRIDE + w, word = (size_t)blk*BLOCK_WORDS + w;
+		uint64_t x = a[offset] & b[offset];
+		if(x==~0ULL)
+		{
+		    for(int k=0; k<5; k++)
+		    {
+			m[k] -= _word_moments[5*word+k];
+		    }
+		    continue;
+		}
+		for(; x; x &= x-1)
+		{
+		    const float *mm = &_marker_moments[5*(word*64 + __builtin_ctzll(x))];
+		    for(int k=0; k<5; k++)
+		    {
+			m[k] -= mm[k];
+		    }
+		}
+	    }
+	}
+    }
+    n[0] = _n00 - m[0];
+    n[1] = _n10 - m[1];
+    n[2] = _n11 - m[2];
+    n[3] = _n20 - m[3];
+    n[4] = _n21 - m[4];
+    n[5] = _n22 - counts.miss;
+}
+
+Kinship::~Kinship()
+{
+    free(_bits);
+    if(_spill_fd>=0)
+    {
+	close(_spill_fd);
+    }
+}
+
+
+/**
+ * @name    countTile
+ * @brief   popcounts for every pair in a tile of the sample x sample triangle
+ *
+ * Markers are streamed TILE_BLOCKS blocks at a time so the rows of both
+ * sample ranges are reused from cache across all pairs in the tile.
+ *
+ * @param [in] i0,i1  	row samples [i0,i1)
+ * @param [in] j0,j1  	column samples [j0,j1), only pairs with j>i are counted
+ * @param [out] counts 	(i-i0)*TILE_SAMPLES+(j-j0) indexed pair counts
+ */
+void Kinship::countTile(int i0,int i1,int j0,int j1,vector<PairCounts> & counts) 
+{
+    assert(i1-i0<=TILE_SAMPLES && j1-j0<=TILE_SAMPLES);
+    counts.assign(TILE_SAMPLES*TILE_SAMPLES,PairCounts());
+    for(int b0=0; b0<_nblock; b0+=TILE_BLOCKS)
+    {
+	int nb = min(TILE_BLOCKS,_nblock-b0);
+	size_t offset = (size_t)b0*BLOCK_STRIDE;
+	for(int i=i0; i<i1; i++)
+	{
+	    const uint64_t *a = row(i) + offset;
+	    PairCounts *c = &counts[(i-i0)*TILE_SAMPLES];
+	    for(int j=max(j0,i+1); j<j1; j++)
+	    {
+		_count(a,row(j)+offset,nb,c[j-j0]);
+	    }
+	}
+    }
+}
+
+/**
+ * @name    countSpilled
+ * @brief   popcounts for every pair in [i0,i1) x [j0,j1) from the spill file
+ *
+ * Each chunk of both sample ranges is read once and all pairs are accumulated
+ * chunk by chunk, threads share the work as TILE_SAMPLES tiles.
+ *
+ * @param [out] counts 	(i-i0)*ldc+(j-j0) indexed pair counts
+ */
+void Kinship::countSpilled(int i0,int i1,int j0,int j1,vector<PairCounts> & counts,int ldc) 
+{
+    assert(spilled() && _bits==NULL);
+    for(int i=i0; i<i1; i++)
+    {
+	fill(counts.begin()+(size_t)(i-i0)*ldc,counts.begin()+(size_t)(i-i0)*ldc+(j1-j0),PairCounts());
+    }
+    uint64_t *a=NULL,*b=NULL;
+    if(posix_memalign((void **)&a, 64, (i1-i0)*_stride*sizeof(uint64_t))!=0 ||
+       posix_memalign((void **)&b, 64, (j1-j0)*_stride*sizeof(uint64_t))!=0)
+    {
+	die("could not allocate memory for kinship tiles");
+    }
+    vector< pair<int,int> > tiles;
+    for(int ti=i0; ti<i1; ti+=TILE_SAMPLES)
+    {
+	for(int tj=(i0==j0 ? ti : j0); tj<j1; tj+=TILE_SAMPLES)
+	{
+	    tiles.push_back(make_pair(ti,tj));
+	}
+    }
+    for(int k=0; k<_nchunk; k++)
+    {
+	int nb = min(_chunk_blocks,_nblock-k*_chunk_blocks);
+	readChunk(k,i0,i1,a);
+	if(j0!=i0)
+	{
+	    readChunk(k,j0,j1,b);
+	}
+	const uint64_t *bb = j0==i0 ? a : b;
+#pragma omp parallel for schedule(dynamic,1)
+	for(size_t t=0; t<tiles.size(); t++)
+	{
+	    int ti = tiles[t].first, tj = tiles[t].second;
+	    for(int i=ti; i<min(ti+TILE_SAMPLES,i1); i++)
+	    {
+		const uint64_t *ra = a + (i-i0)*_stride;
+		PairCounts *c = &counts[(size_t)(i-i0)*ldc];
+		for(int j=max(tj,i+1); j<min(tj+TILE_SAMPLES,j1); j++)
+		{
+		    _count(ra,bb+(j-j0)*_stride,nb,c[j-j0]);
+		}
+	    }
+	}
+    }
+    free(a);
+    free(b);
+}
+
 void Kinship::estimateKinship(int j1,int j2,float & ibd0, float & ibd1, float & ibd2,float & ibd3,float & ks,int method) 
 {
-    ibd0 = 0;
-    ibd1 = 0;
-    ibd2 = 0;
-    ibd3 = 0;
-    ks=-1;
-    for(size_t i=0; i<_bits[j1].size(); ++i)
-    {
-	// //opposite homozygotes. NAA,aa
-	// ibd0 += _lookup[(_bits[j1][i][0] & _bits[j2][i][2]).to_ulong()] + _lookup[(_bits[j1][i][2] & _bits[j2][i][0]).to_ulong()];
-	// //same genotype.  
-	// ibd2 += _lookup[(_bits[j1][i][0] & _bits[j2][i][0]).to_ulong()] + _lookup[(_bits[j1][i][1] & _bits[j2][i][1]).to_ulong()] + _lookup[(_bits[j1][i][2] & _bits[j2][i][2]).to_ulong()];
-	// //missing in both.
-	// ibd3 += _lookup[(_bits[j1][i][3] | _bits[j2][i][3]).to_ulong()];
-
-//opposite homozygotes. NAA,aa
-	ibd0 += (_bits[j1][i][0] & _bits[j2][i][2]).count() + (_bits[j1][i][2] & _bits[j2][i][0]).count();
-//same genotype.  
-	ibd2 += (_bits[j1][i][0] & _bits[j2][i][0]).count() + (_bits[j1][i][1] & _bits[j2][i][1]).count() + (_bits[j1][i][2] & _bits[j2][i][2]).count();
-//missing in both.
-	ibd3 += (_bits[j1][i][3] | _bits[j2][i][3]).count();
+    PairCounts counts;
+    countPair(j1,j2,counts);
+    estimateKinship(j1,j2,counts,ibd0,ibd1,ibd2,ibd3,ks,method);
+}
 
-    }
+void Kinship::estimateKinship(int j1,int j2,const PairCounts & counts,float & ibd0, float & ibd1, float & ibd2,float & ibd3,float & ks,int method,bool normalise) 
+{
+    ks=-1;
+    ibd0 = counts.ibs0;
+    ibd2 = counts.ibs2;
+    ibd3 = counts.miss;
 //consistent with IBD1 N - (NAA,AA + Naa,aa)
     ibd1 = _markers-ibd3-ibd0-ibd2;
 
+    float n[6] = {_n00,_n10,_n11,_n20,_n21,_n22};
+    if(_pairwise_missing)
+    {
+	pairMoments(j1,j2,counts,n);
+    }
+
     if(method==0) 
     {
-	estimateIBD(ibd0,ibd1,ibd2,ibd3);
+	estimateIBD(n,ibd0,ibd1,ibd2,ibd3,normalise);
 	ks = 0.5 * ibd2 + 0.25 * ibd1;
     }
     if(method==1)//king
     {
-	int Nhet_1=0,Nhet_2=0,Nhet_12=0;
-	for(size_t i=0; i<_bits[j1].size(); ++i)
+	int Nhet_1=_nhet[j1]; //NAa^i
+	int Nhet_2=_nhet[j2]; //NAa^j
+	if(_pairwise_missing)//only heterozygotes at markers the other sample has called
 	{
-	    Nhet_1 += _bits[j1][i][1].count(); //NAa^i
-	    Nhet_2 += _bits[j2][i][1].count(); //NAa^j
-	    Nhet_12 += (_bits[j1][i][1] & _bits[j2][i][1]).count(); //NAa,Aa
+	    Nhet_1 -= counts.hetmiss_a;
+	    Nhet_2 -= counts.hetmiss_b;
 	}
+	int Nhet_12=counts.hethet; //NAa,Aa
 	int minhet=min(Nhet_1,Nhet_2);
 	ks = (Nhet_12 - 2*ibd0)/(2*minhet) + 0.5 - 0.25*(Nhet_1+Nhet_2)/minhet;
-	estimateIBD(ibd0,ibd1,ibd2,ibd3);
+	estimateIBD(n,ibd0,ibd1,ibd2,ibd3);
     }
 }
 
 void Kinship::estimateIBD(float & ibd0, float & ibd1, float & ibd2,float & ibd3,bool normalise) 
+{
+    float n[6] = {_n00,_n10,_n11,_n20,_n21,_n22};
+    estimateIBD(n,ibd0,ibd1,ibd2,ibd3,normalise);
+}
+
+///method of moments given the expected counts n = n00,n10,n11,n20,n21,n22
+void Kinship::estimateIBD(const float *n,float & ibd0, float & ibd1, float & ibd2,float & ibd3,bool normalise) 
 {
 ///method of moments
-    ibd0 /= _n00;	
-    ibd1 = (ibd1 - ibd0*_n10)/_n11;
-    ibd2 = (ibd2 - ibd0*_n20 - ibd1*_n21)/_n22;
+    ibd0 /= n[0];	
+    ibd1 = (ibd1 - ibd0*n[1])/n[2];
+    ibd2 = (ibd2 - ibd0*n[3] - ibd1*n[4])/n[5];
     ibd3 = _n22 - ibd3;
 
 ///_normalize i_n [0,1]
@@ -238,7 +931,108 @@ void Kinship::estimateIBD(float & ibd0, float & ibd1, float & ibd2,float & ibd3,
     }
 }
 
+/**
+ * @name    append_fixed
+ * @brief   append x to buf exactly as printf("%.*f",digits,x) would
+ *
+ * A float widened to double and scaled by 10^digits (digits<=5) is exact, so
+ * rounding it half-to-even reproduces printf without the iostream overhead.
+ */
+static void append_fixed(string &buf,float x,int digits)
+{
+    static const double scale[] = {1,1e1,1e2,1e3,1e4,1e5};
+    assert(digits>=0 && digits<=5);
+    double y = (double)x * scale[digits];
+    if(!(fabs(y) < 1e15))//nan/inf/huge
+    {
+	char tmp[64];
+	int n = snprintf(tmp,sizeof(tmp),"%.*f",digits,x);
+	buf.append(tmp,n);
+	return;
+    }
+    if(signbit(x))
+    {
+	buf += '-';
+    }
+    unsigned long long v = (unsigned long long)nearbyint(fabs(y));
+    unsigned long long p = (unsigned long long)scale[digits];
+    char tmp[32];
+    int n = 0;
+    unsigned long long ip = v / p, fp = v % p;
+    do
+    {
+	tmp[n++] = '0' + ip%10;
+	ip/=10;
+    } while(ip>0);
+    while(n>0)
+    {
+	buf += tmp[--n];
+    }
+    if(digits>0)
+    {
+	buf += '.';
+	for(int i=digits-1; i>=0; i--)
+	{
+	    tmp[i] = '0' + fp%10;
+	    fp/=10;
+	}
+	buf.append(tmp,digits);
+    }
+}
+
+///one line of kin output
+static void append_pair(string &buf,const char *id1,const char *id2,float ibd0,float ibd1,float ibd2,float ks,float nsnp)
+{
+    buf += id1;
+    buf += '\t';
+    buf += id2;
+    buf += "\t ";
+    append_fixed(buf,ibd0,5);
+    buf += ' ';
+    append_fixed(buf,ibd1,5);
+    buf += ' ';
+    append_fixed(buf,ibd2,5);
+    buf += ' ';
+    append_fixed(buf,ks,5);
+    buf += ' ';
+    append_fixed(buf,nsnp,0);
+    buf += '\n';
+}
+
+///per-thread output is written to stdout once it grows past this many bytes
+#define OUTPUT_CHUNK (1<<20)
+
 #define FORCE 100
+///long-only options are numbered past the ASCII range so they cannot clash with -f/-h
+#define ORDERED 201
+#define MEMORY 202
+#define TMPDIR 203
+#define SAVE_STATE 204
+#define LOAD_STATE 205
+#define SKETCH 206
+#define SKETCH_Z 207
+#define PAIRWISE_MISSING 208
+#define STATS_JSON 209
+
+///groups of sketch blocks, the spread of their estimates gives the bound
+#define SKETCH_GROUPS 8
+///fixed so the sketch (and the output) is reproducible
+#define SKETCH_SEED 19800621
+
+///identifies a marker across runs in a state file
+static string kin_site_key(const bcf_hdr_t *hdr,bcf1_t *line)
+{
+    bcf_unpack(line,BCF_UN_STR);
+    string key = bcf_hdr_id2name(hdr,line->rid);
+    key += ':' + to_string(line->pos+1);
+    for(int i=0; i<line->n_allele; i++)
+    {
+	key += ':';
+	key += line->d.allele[i];
+    }
+    return key;
+}
+
 int kin_main(int argc, char* argv[])
 {
 	
@@ -258,9 +1052,32 @@ int kin_main(int argc, char* argv[])
 	{"samples",1,0,'s'},
 	{"samples-file",1,0,'S'},
 	{"force",0,0,FORCE},	
+	{"ordered",0,0,ORDERED},	
+	{"output",1,0,'o'},	
+	{"memory",1,0,MEMORY},	
+	{"tmpdir",1,0,TMPDIR},	
+	{"output-type",1,0,'O'},	
+	{"pairfile",1,0,'f'},	
+	{"sketch",1,0,SKETCH},	
+	{"sketch-z",1,0,SKETCH_Z},	
+	{"save-state",1,0,SAVE_STATE},	
+	{"load-state",1,0,LOAD_STATE},	
+	{"pairwise-missing",0,0,PAIRWISE_MISSING},	
+	{"stats-json",1,0,STATS_JSON},	
 	{0,0,0,0}
     };
     int method=0;
+    bool ordered = false;
+    string output_name = "";
+    char output_type = 't';
+    size_t max_memory = 0;
+    string tmpdir = getenv("TMPDIR")!=NULL ? getenv("TMPDIR") : "/tmp";
+    string save_state = "";
+    string load_state = "";
+    float sketch_fraction = 0;
+    float sketch_z = 6;
+    bool pairwise_missing = false;
+    string stats_json = "";
     string regions = "";
     bool regions_is_file = false;
     string targets = "";
@@ -281,7 +1098,7 @@ int kin_main(int argc, char* argv[])
     bool used_T = false;
 
     string frq_file="";  
-    while ((c = getopt_long(argc, argv, "T:t:R:r:M:F:k:h:@:m:a:s:S:f",loptions,NULL)) >= 0) 
+    while ((c = getopt_long(argc, argv, "T:t:R:r:M:F:k:h:@:m:a:s:S:f:o:O:",loptions,NULL)) >= 0) 
     {  
 	switch (c)
 	{
@@ -292,8 +1109,20 @@ int kin_main(int argc, char* argv[])
 	case 'F': frq_file=optarg;break;
 	case 'M': method=atoi(optarg);break;
 	case 'k': tk = true; min_kin = atof(optarg); break;
+	case 'f': pairfile = optarg; break;
 	case '@': nthreads = atoi(optarg); break;
 	case FORCE: force = true; break;
+	case ORDERED: ordered = true; break;
+	case 'o': output_name = optarg; break;
+	case MEMORY: max_memory = (size_t)(atof(optarg)*1024*1024); break;
+	case TMPDIR: tmpdir = optarg; break;
+	case 'O': output_type = optarg[0]; break;
+	case SAVE_STATE: save_state = optarg; break;
+	case LOAD_STATE: load_state = optarg; break;
+	case SKETCH: sketch_fraction = atof(optarg); break;
+	case SKETCH_Z: sketch_z = atof(optarg); break;
+	case PAIRWISE_MISSING: pairwise_missing = true; break;
+	case STATS_JSON: stats_json = optarg; break;
 	case 'a': af_tag = string(optarg); break;
 	case 's': sargs.sample_names = (optarg); sargs.subsample = true; break;
 	case 'S': sargs.sample_names = (optarg); sargs.subsample = true; sargs.sample_is_file = 1; break;
@@ -301,11 +1130,91 @@ int kin_main(int argc, char* argv[])
 	default: cerr << "Unknown argument:"+(string)optarg+"\n" << endl; exit(1);
 	}
     }
-    if(!force && targets.empty() && regions.empty() && frq_file.empty())
+    RunStats stats;
+    stats.open("kin",stats_json);
+    if(!force && load_state.empty() && targets.empty() && regions.empty() && frq_file.empty())
     {
 	die("None of -R/-F/-T were provided.\n       kin does not require a dense set of markers and this can substantially increase compute time.\n       You can disable this error with --force");
     }
 
+    if(output_type!='t' && output_type!='b' && output_type!='h' && output_type!='g')
+    {
+	die("-O must be one of t/b/h/g");
+    }
+    bool binary_output = output_type!='t';
+    bool graph_output = output_type=='g';
+    if(binary_output && output_name.empty())
+    {
+	die("-O b/h/g requires an output file (-o)");
+    }
+    if(binary_output && !graph_output && tk)
+    {
+	die("-k cannot be used with binary output, which stores every pair");
+    }
+    if(graph_output && !tk)
+    {
+	die("-O g keeps the pairs above -k, so -k is required");
+    }
+    if(graph_output && max_memory>0)
+    {
+	die("-O g cannot be used with --memory, its families are computed from the genotypes in memory");
+    }
+
+    if(max_memory>0 && ordered)
+    {
+	die("--ordered cannot be used with --memory");
+    }
+    if(max_memory>0 && (!save_state.empty() || !load_state.empty()))
+    {
+	die("--memory cannot be used with --save-state/--load-state");
+    }
+    if(!pairfile.empty() && (binary_output || max_memory>0))
+    {
+	die("-f cannot be used with binary output or --memory");
+    }
+    if(sketch_fraction!=0)
+    {
+	if(sketch_fraction<0 || sketch_fraction>=1)
+	{
+	    die("--sketch must be in (0,1)");
+	}
+	if(!tk)
+	{
+	    die("--sketch prunes pairs below the -k threshold, so -k is required");
+	}
+	if(max_memory>0 || !pairfile.empty())
+	{
+	    die("--sketch cannot be used with --memory or -f");
+	}
+    }
+    if(pairwise_missing && max_memory>0)
+    {
+	die("--pairwise-missing cannot be used with --memory");
+    }
+    if(method==2)
+    {
+	if(output_name.empty())
+	{
+	    die("-M 2 writes GCTA's binary GRM files, give their prefix with -o");
+	}
+	if(tk || binary_output || !pairfile.empty() || max_memory>0 || sketch_fraction!=0 || pairwise_missing || !save_state.empty() || !load_state.empty())
+	{
+	    die("-M 2 cannot be used with -k, -O, -f, --memory, --sketch, --pairwise-missing or --save-state/--load-state");
+	}
+    }
+    if(!load_state.empty() && binary_output)
+    {
+	die("--load-state appends new pairs to text output, binary output must be recomputed");
+    }
+    if(!load_state.empty() && !frq_file.empty())
+    {
+	die("-F cannot be used with --load-state, frequencies are taken from the state file");
+    }
+    if(!save_state.empty() && load_state.empty() && frq_file.empty())
+    {
+	die("--save-state requires -F, pairs added later must use the same allele frequencies as the saved ones");
+    }
+
     if(method<0 || method>2) {
 	cerr << "ERROR: method must be one of 0/1/2"<<endl;
 	exit(1);
@@ -374,6 +1283,16 @@ int kin_main(int argc, char* argv[])
     bcf_srs_t *sr =  bcf_sr_init() ; ///htslib synced reader.
     sr->collapse = COLLAPSE_NONE;		///require matching ALTs
     sr->require_index = 1;			///require indexed VCF
+//BGZF decompression threads. htslib 1.6 deadlocks seeking a threaded BGZF
+//stream, so they are only used when the file is streamed rather than indexed into.
+    if(nthreads>1 && regions.empty() && bcf_sr_set_threads(sr,nthreads)<0)
+    {
+	die("could not start "+to_string(nthreads)+" decompression threads");
+    }
+    if(nthreads>1 && !regions.empty())
+    {
+	cerr << "Note: -r/-R/-F input is read without decompression threads, -@ applies to decoding and the pairwise calculation" << endl;
+    }
 
     ///subset regions
     if(!regions.empty())
@@ -422,12 +1341,6 @@ int kin_main(int argc, char* argv[])
 	die("no samples!");
     }
 
-    if(method==2) //jump out to GRM routine.
-    {
-	die("method 2 (GRM) is deprecated. Try plink or GCTA.");
-//	return(grm(sr));
-    }
- 
     int N = bcf_hdr_nsamples(hdr);	///number of samples
     cerr << N << " samples" << endl;
 
@@ -436,87 +1349,209 @@ int kin_main(int argc, char* argv[])
 // 	cout << i << " "<<hdr->samples[i]<<endl;
 //     }
 
-    if(N<50 && frq_file.empty())
+    if(N<50 && frq_file.empty() && load_state.empty())
     {
 	cerr<<"WARNING: your sample size is <50 and you have NOT provided population frequencies (-F)."<<endl;
     }
 
     Nsamples = N;
     Kinship K(Nsamples);
+    K.setMethod(method,pairwise_missing);
+
+//incremental mode: the saved samples come first and only pairs with a new sample are computed
+    vector<string> names;///all samples in row order
+    vector<string> site_keys;///key of each marker, for --save-state
+    unordered_map<string,int> site_index;
+    bool fixed_af = !frq_file.empty();
+    int first_new = 0;
+    if(!load_state.empty())
+    {
+	cerr << "Loading "<<load_state<<"...";
+	first_new = K.loadState(load_state,names,site_keys,fixed_af);
+	cerr << "done."<<endl;
+	if(!fixed_af)//the earlier pairs used frequencies that the new samples would change
+	{
+	    die(load_state+" was saved without -F, its pairs cannot be extended with the same allele frequencies");
+	}
+	cerr << first_new << " samples and " << K._markers << " markers in "<<load_state<<endl;
+	set<string> old_names(names.begin(),names.end());
+	for(int i=0;i<N;i++)
+	{
+	    if(old_names.count(hdr->samples[i]))
+	    {
+		die(string(hdr->samples[i])+" is already in "+load_state);
+	    }
+	}
+	for(int m=0;m<K._markers;m++)
+	{
+	    site_index[site_keys[m]] = m;
+	}
+	Nsamples = K._nsample;
+    }
+    names.insert(names.end(),hdr->samples,hdr->samples+N);
+    if(max_memory>0)
+    {
+	cerr << "Spilling genotypes to "<<tmpdir<<" with a memory cap of "<<max_memory/1024/1024<<"MB"<<endl;
+	K.enableSpill(tmpdir,max_memory);
+    }
 
     int count=0;
 
-    bcf1_t *line, *line2;///bcf/vcf line structure.
-	
-    int *gt_arr=(int *)malloc(N*2*sizeof(int)),ngt=N*2,ngt_arr=N*2;
     float *af_ptr=(float *)malloc(1*sizeof(float)); int nval = 1;
 
-
+//a background thread reads and parses records while the previous batch is decoded
+//in parallel over sites and packed into bit-planes in parallel over samples.
+//which sites are used is decided in file order, as thinning depends on it.
     bool use_frq = !frq_file.empty();
+    vector<BcfSite> batch;
+    vector<uint8_t> code_batch((size_t)PIPELINE_BATCH*N);
+    vector<int> site_marker(PIPELINE_BATCH);///-2: skip -1: new marker >=0: saved marker (--load-state)
+    vector<int> site_ok(PIPELINE_BATCH);
+    vector<GtCounts> site_counts(PIPELINE_BATCH);
+    vector<const uint8_t *> kept_gt;
+    vector<float> kept_p;
+    vector<int> kept_ac,kept_an;
+    Grm *grm = method==2 ? new Grm(N) : NULL;///-M 2 multiplies the markers in as they are read
+    BcfPipeline pipe(sr);
     cerr << "Reading genotypes...";
-    while(bcf_sr_next_line (sr))  ///read file
+    double read_start = wall_time(), pack_seconds = 0;
+    while(pipe.next(batch))
     {
-	if(bcf_sr_has_line(sr,0) && (!use_frq||bcf_sr_has_line(sr,1)) )  ///present in the study file (and frequency file)
+	int nb = batch.size();
+	for(int r=0;r<nb;r++)
 	{
-	    int nmiss=0;
-	    int npres=0;
-	    int sum = 0;	///AC
-
-	    line =  bcf_sr_get_line(sr, 0);
-
-	    if(line->n_allele == 2 && (count++)%thin==0 )		///bi-allelic
+	    bcf1_t *line = batch[r].line[0];
+	    site_marker[r] = -2;
+	    if(line!=NULL && (!use_frq||batch[r].line[1]!=NULL) )  ///present in the study file (and frequency file)
 	    {
-		ngt = bcf_get_genotypes(hdr, line, &gt_arr, &ngt_arr);  
-		assert(ngt==2*N);
-		if(ngt < 0)
-		{ 
-		    cerr << "Bad genotypes at " << line->pos+1 << endl; exit(1); 
-		}			
-		for(int i=0;i<2*N;i++)		///htslib -> int
-		{ 
-		    if( bcf_gt_is_missing(gt_arr[i]) || bcf_gt_allele(gt_arr[i])<0 || bcf_gt_allele(gt_arr[i])>2 )
-		    {
-			gt_arr[i] = -1;
-			++nmiss;
-		    } 
-		    else 
+		if(line->n_allele == 2 && !load_state.empty())	///new samples at a saved marker
+		{
+		    unordered_map<string,int>::iterator m = site_index.find(kin_site_key(hdr,line));
+		    if(m != site_index.end())
 		    {
-			sum += bcf_gt_allele(gt_arr[i]);
-			++npres;
+			site_marker[r] = m->second;
 		    }
 		}
-		float p;
-		if(frq_file.empty())///calculate AF from data
-		{
-		    p = (float)sum / (float)(npres);	///allele frequency
-		} 
-		else 
+		else if(line->n_allele == 2 && (count++)%thin==0 )		///bi-allelic
 		{
-		    assert(bcf_sr_has_line(sr,1));	///present in sites file.      
-		    line2 =  bcf_sr_get_line(sr, 1);
-		    num_sites++;
-		    ++sites;
-		    int ret = bcf_get_info_float(sr->readers[1].header, line2, af_tag.c_str(), &af_ptr, &nval);
-		    if( ret<0 || nval != 1 )
-		    { 
-			cerr << af_tag << " read error at " << line2->rid << ":" << line->pos+1 << endl; exit(1); 
-		    }
-		    p = af_ptr[0];
+		    site_marker[r] = -1;
+		}
+		++num_study;
+	    }
+	}
+
+#pragma omp parallel for schedule(dynamic,4)
+	for(int r=0;r<nb;r++)
+	{
+	    if(site_marker[r]!=-2)
+	    {
+		site_ok[r] = decode_gt(hdr,batch[r].line[0],&code_batch[(size_t)r*N],site_counts[r]);
+	    }
+	}
+
+	for(int r=0;r<nb;r++)
+	{
+	    if(site_marker[r]==-2)
+	    {
+		continue;
+	    }
+	    bcf1_t *line = batch[r].line[0];
+	    if(site_ok[r] < 0)
+	    { 
+		cerr << "Bad genotypes at " << line->pos+1 << endl; exit(1); 
+	    }			
+	    const uint8_t *gt = &code_batch[(size_t)r*N];
+	    if(site_marker[r]>=0)
+	    {
+		K.setGenotypes(site_marker[r],first_new,gt,site_counts[r]);
+		++num_sites;
+		continue;
+	    }
+	    float p;
+	    if(frq_file.empty())///calculate AF from data
+	    {
+		p = (float)site_counts[r].ac / (float)(site_counts[r].an);	///allele frequency
+	    } 
+	    else 
+	    {
+		bcf1_t *line2 = batch[r].line[1];
+		num_sites++;
+		++sites;
+		int ret = bcf_get_info_float(sr->readers[1].header, line2, af_tag.c_str(), &af_ptr, &nval);
+		if( ret<0 || nval != 1 )
+		{ 
+		    cerr << af_tag << " read error at " << line2->rid << ":" << line->pos+1 << endl; exit(1); 
 		}
-		if( (p < 0.5) ? ( p > min_freq ) : (1-p > min_freq) )///min af	  
+		p = af_ptr[0];
+	    }
+	    if( (p < 0.5) ? ( p > min_freq ) : (1-p > min_freq) )///min af	  
+	    {
+		kept_gt.push_back(gt);
+		kept_p.push_back(p);
+		kept_ac.push_back(site_counts[r].ac);
+		kept_an.push_back(site_counts[r].an);
+		if(!save_state.empty())
 		{
-		    K.addGenotypes(gt_arr,p);
+		    site_keys.push_back(kin_site_key(hdr,line));
 		}
-	    } //thin			
-	    ++num_study;
-	} //in study
+	    }
+	}
+	double pack_start = wall_time();
+	if(!kept_gt.empty() && grm!=NULL)
+	{
+	    grm->addMarkers(&kept_gt[0],&kept_p[0],kept_gt.size());
+	    kept_gt.clear();
+	    kept_p.clear();
+	    kept_ac.clear();
+	    kept_an.clear();
+	}
+	else if(!kept_gt.empty())
+	{
+	    K.addGenotypes(&kept_gt[0],&kept_p[0],&kept_ac[0],&kept_an[0],kept_gt.size());
+	    kept_gt.clear();
+	    kept_p.clear();
+	    kept_ac.clear();
+	    kept_an.clear();
+	}
+	pack_seconds += wall_time()-pack_start;
     }//reader
     cerr << "done."<<endl;
-    free(gt_arr);
     free(af_ptr);
+//for -M 2 the chunks are multiplied in as they are packed
+    stats.addTime("ingest",wall_time()-read_start-pack_seconds);
+    stats.addTime(grm!=NULL ? "product" : "packing",pack_seconds);
+    stats.set("samples",Nsamples);
+    stats.set("threads",nthreads);
+    stats.set("sites_read",num_study);
+    if(grm!=NULL)
+    {
+	cerr << "Using "<<grm->markers()<<" markers for calculations"<<endl;
+	double start = wall_time();
+	grm->finish();
+	stats.addTime("product",wall_time()-start);
+	cerr << "Writing "<<output_name<<".grm.bin/.grm.N.bin/.grm.id"<<endl;
+	start = wall_time();
+	grm->write(output_name,names);
+	stats.addTime("output",wall_time()-start);
+	stats.set("markers",grm->markers());
+	stats.write();
+	delete grm;
+	bcf_sr_destroy(sr);
+	return(0);
+    }
+    stats.set("markers",K._markers);
+    if(K.spilled())
+    {
+	K.finishSpill();
+    }
 
 
-    if(frq_file.empty()) 
+    if(!load_state.empty())
+    {
+	cerr << num_sites << "/" << K._markers << " saved markers were found in " << filename << endl;
+	K.updateFrequencies(fixed_af);
+    }
+    else if(frq_file.empty()) 
     {
 	cerr << "Using "<<K._markers<<" markers for calculations"<<endl;
     }
@@ -525,31 +1560,395 @@ int kin_main(int argc, char* argv[])
 	cerr << "Kept " << K._markers << " markers out of " << sites << " in panel." << endl;
 	cerr << num_study << "/"<<num_sites<<" of study markers were in the sites file"<<endl;
     }
-    cerr << "Calculating kinship values...";
-
-//ordered lets us enforce ordereing but slows down code
-//#pragma omp parallel for ordered
-#pragma omp parallel for
-    for(int j1=0;j1<Nsamples;j1++) 
-    {
-	for(int j2=j1+1;j2<Nsamples;j2++) 
-	{
-	    float ibd0,ibd1,ibd2,ibd3,ks;
-	    K.estimateKinship(j1,j2,ibd0,ibd1,ibd2,ibd3,ks,method);
-	    if( !tk || ks > min_kin )
-	      {
-//#pragma omp ordered 
-#pragma omp critical
-	      {		    
-		  string id1=hdr->samples[j1];
-		  string id2=hdr->samples[j2];
-		  cout  <<  id1<<"\t" <<id2 << "\t" << left << " " << setprecision(5) << fixed << ibd0  << left << " " << setprecision(5) << fixed << ibd1  << left << " " << setprecision(5) << fixed << ibd2  << left << " " << setprecision(5) << fixed << ks << " " << setprecision(0) <<ibd3 << "\n";
+    if(!save_state.empty())
+    {
+	cerr << "Saving "<<Nsamples<<" samples to "<<save_state<<endl;
+	K.saveState(save_state,names,site_keys,fixed_af);
+    }
+    if(pairwise_missing)
+    {
+	K.prepareMissing();
+    }
+//the sketch is SKETCH_GROUPS small copies of K, each holding a share of a random subset of blocks
+    vector<Kinship *> sketch;
+    if(sketch_fraction>0)
+    {
+	int nsub = max(2,(int)(sketch_fraction*K.nblock()+0.5));
+	if(nsub >= K.nblock())
+	{
+	    cerr << "WARNING: the sketch would use every marker block, --sketch is ignored"<<endl;
+	}
+	else
+	{
+	    vector<int> blocks(K.nblock());
+	    iota(blocks.begin(),blocks.end(),0);
+	    mt19937 rng(SKETCH_SEED);
+	    shuffle(blocks.begin(),blocks.end(),rng);
+	    int ngroup = min(SKETCH_GROUPS,nsub);
+	    for(int g=0;g<ngroup;g++)
+	    {
+		vector<int> group;
+		for(int b=g;b<nsub;b+=ngroup)
+		{
+		    group.push_back(blocks[b]);
+		}
+		sort(group.begin(),group.end());
+		sketch.push_back(new Kinship(K,group));
+	    }
+	    cerr << "Screening pairs on "<<nsub<<" of "<<K.nblock()<<" marker blocks in "<<ngroup<<" groups"<<endl;
+	}
+    }
+    long npair_screened=0,npair_kept=0;
+
+    cerr << "Calculating kinship values (" << pair_counter_name() << " popcount)...";
+//pairwise is the time spent counting (summed over threads and divided by their number
+//when counting runs inside the parallel loop), output is the rest: estimates, formatting and writing
+    double pairs_start = wall_time(), count_seconds = 0;
+    bool timing = stats.enabled();
+    long npair = (long)Nsamples*(Nsamples-1)/2 - (long)first_new*(first_new-1)/2;
+
+    ofstream text_file;
+    ostream & text_out = output_name.empty() ? cout : text_file;
+    KinshipFileWriter *binary_out = NULL;
+    KinshipGraphWriter *graph_out = NULL;
+    if(graph_output)
+    {
+	graph_out = new KinshipGraphWriter(output_name,names,min_kin,nthreads);
+	ordered = false;
+    }
+    else if(binary_output)
+    {
+	binary_out = new KinshipFileWriter(output_name,names,output_type=='h' ? KIN_FLOAT16 : KIN_FLOAT32);
+	ordered = false;
+    }
+    else if(!output_name.empty())
+    {
+	text_file.open(output_name.c_str(), load_state.empty() ? ios::out : ios::app);
+	if(!text_file.is_open())
+	{
+	    die("could not open "+output_name);
+	}
+    }
+
+    ///estimates one pair from its counts and writes it to out (or the binary file)
+    auto emit = [&](int j1,int j2,const PairCounts & counts,string & out)
+    {
+	float ibd0,ibd1,ibd2,ibd3,ks;
+	K.estimateKinship(j1,j2,counts,ibd0,ibd1,ibd2,ibd3,ks,method);
+	if(binary_out!=NULL)
+	{
+	    binary_out->set(j1,j2,ibd0,ibd1,ibd2,ks,ibd3);
+	}
+	else if(graph_out!=NULL)
+	{
+	    if(ks > min_kin)
+	    {
+		graph_out->add(omp_get_thread_num(),j1,j2,ibd0,ibd1,ibd2,ks,ibd3);
+	    }
+	}
+	else if( !tk || ks > min_kin )
+	{
+	    append_pair(out,names[j1].c_str(),names[j2].c_str(),ibd0,ibd1,ibd2,ks,ibd3);
+	}
+    };
+
+    if(!pairfile.empty())
+    {
+//only the listed pairs, in the order given. pairs are estimated in parallel a batch
+//at a time and each chunk of a batch is formatted separately so output stays in order.
+	ifstream in(pairfile.c_str());
+	map<string,int> name_to_id;
+	for(int i=0;i<Nsamples;i++)
+	{
+	    name_to_id[names[i]] = i;
+	}
+	vector< pair<string, string> > relpairs;
+	read_pairs(in,relpairs,name_to_id);
+	vector< pair<int,int> > pairs(relpairs.size());
+	for(size_t k=0;k<relpairs.size();k++)
+	{
+	    pairs[k] = make_pair(name_to_id[relpairs[k].first],name_to_id[relpairs[k].second]);
+	}
+	const size_t chunk = 256;
+	const size_t batch = 256*chunk;
+	vector<string> chunk_out(batch/chunk);
+	npair = pairs.size();
+	for(size_t k0=0;k0<pairs.size();k0+=batch)
+	{
+	    size_t k1 = min(k0+batch,pairs.size());
+	    size_t nchunk = (k1-k0+chunk-1)/chunk;
+	    double start = wall_time();
+#pragma omp parallel for schedule(dynamic,1)
+	    for(size_t c=0;c<nchunk;c++)
+	    {
+		string & out = chunk_out[c];
+		out.clear();
+		for(size_t k=k0+c*chunk;k<min(k0+(c+1)*chunk,k1);k++)
+		{
+		    int j1 = pairs[k].first, j2 = pairs[k].second;
+		    float ibd0,ibd1,ibd2,ibd3,ks;
+		    K.estimateKinship(j1,j2,ibd0,ibd1,ibd2,ibd3,ks,method);
+		    if( !tk || ks > min_kin )
+		    {
+			append_pair(out,names[j1].c_str(),names[j2].c_str(),ibd0,ibd1,ibd2,ks,ibd3);
+		    }
+		}
+	    }
+	    count_seconds += wall_time()-start;
+	    for(size_t c=0;c<nchunk;c++)
+	    {
+		text_out.write(chunk_out[c].data(),chunk_out[c].size());
+	    }
+	}
+    }
+    else if(K.spilled())
+    {
+//out-of-core: the triangle is processed as band x band blocks whose counters fit
+//in half the memory budget, each block streams the spilled chunks of its two bands
+	int band = (int)sqrt((double)max_memory/2/sizeof(PairCounts));
+	band = max(TILE_SAMPLES,band/TILE_SAMPLES*TILE_SAMPLES);
+	band = min(band,Nsamples);
+	vector<PairCounts> counts((size_t)band*band);
+	for(int i0=0;i0<Nsamples;i0+=band) 
+	{
+	    int i1 = min(i0+band,Nsamples);
+	    for(int j0=i0;j0<Nsamples;j0+=band) 
+	    {
+		int j1 = min(j0+band,Nsamples);
+		double start = wall_time();
+		K.countSpilled(i0,i1,j0,j1,counts,band);
+		count_seconds += wall_time()-start;
+#pragma omp parallel
+		{
+		    string buf;
+#pragma omp for schedule(dynamic,1)
+		    for(int r=i0;r<i1;r++)
+		    {
+			for(int c=max(j0,r+1);c<j1;c++)
+			{
+			    emit(r,c,counts[(size_t)(r-i0)*band+c-j0],buf);
+			}
+			if(buf.size() > OUTPUT_CHUNK)
+			{
+#pragma omp critical(kin_output)
+			    text_out.write(buf.data(),buf.size());
+			    buf.clear();
+			}
+		    }
+		    if(!buf.empty())
+		    {
+#pragma omp critical(kin_output)
+			text_out.write(buf.data(),buf.size());
+		    }
+		}
+	    }
+	}
+    }
+    else
+    {
+//the triangle is cut into TILE_SAMPLES x TILE_SAMPLES tiles handed out dynamically,
+//diagonal tiles do half the work of the others so a static split would be unbalanced.
+//with --load-state only the columns of the new samples are visited.
+	vector< pair<int,int> > tiles;
+	for(int i0=0;i0<Nsamples;i0+=TILE_SAMPLES) 
+	{
+	    for(int j0=max(i0,first_new/TILE_SAMPLES*TILE_SAMPLES);j0<Nsamples;j0+=TILE_SAMPLES) 
+	    {
+		tiles.push_back(make_pair(i0,j0));
+	    }
+	}
+
+//each thread formats into its own buffer. unordered output is flushed in large chunks,
+//ordered output is kept per tile and written one band of rows at a time once every
+//tile in the band (and all earlier bands) has finished.
+	int nband = (Nsamples+TILE_SAMPLES-1)/TILE_SAMPLES;
+	vector<string> tile_out(ordered ? tiles.size() : 0);
+	vector< vector<size_t> > tile_rows(ordered ? tiles.size() : 0);///offset of each row in tile_out
+	vector<int> band_remaining(nband,0);
+	vector<size_t> band_start(nband,0);///index of first tile in band
+	for(size_t t=tiles.size();t-->0;)
+	{
+	    band_remaining[tiles[t].first/TILE_SAMPLES]++;
+	    band_start[tiles[t].first/TILE_SAMPLES] = t;
+	}
+	int next_band = 0;
+
+	double thread_seconds = 0;
+#pragma omp parallel reduction(+:npair_screened,npair_kept,thread_seconds)
+	{
+	    vector<PairCounts> counts;
+	    vector< vector<PairCounts> > sketch_counts(sketch.size());
+	    string buf;
+#pragma omp for schedule(dynamic,1)
+	    for(size_t t=0;t<tiles.size();t++) 
+	    {
+		int row0 = tiles[t].first, row1 = min(row0+TILE_SAMPLES,Nsamples);
+		int col0 = tiles[t].second, col1 = min(col0+TILE_SAMPLES,Nsamples);
+		string & out = ordered ? tile_out[t] : buf;
+		double start = timing ? wall_time() : 0;
+		if(sketch.empty())
+		{
+		    K.countTile(row0,row1,col0,col1,counts);
+		}
+		for(size_t g=0;g<sketch.size();g++)
+		{
+		    sketch[g]->countTile(row0,row1,col0,col1,sketch_counts[g]);
+		}
+		if(timing)
+		{
+		    thread_seconds += wall_time()-start;
+		}
+		for(int j1=row0;j1<row1;j1++) 
+		{
+		    if(ordered)
+		    {
+			tile_rows[t].push_back(out.size());
+		    }
+		    for(int j2=max(max(col0,j1+1),first_new);j2<col1;j2++) 
+		    {
+			size_t idx = (j1-row0)*TILE_SAMPLES+j2-col0;
+			if(sketch.empty())
+			{
+			    emit(j1,j2,counts[idx],out);
+			    continue;
+			}
+//screen on the mean of the group estimates plus sketch_z standard errors,
+//pairs with an undefined bound are kept. -k is compared with the clamped
+//estimate, but clamped group estimates are often all 0 for a related pair and
+//have no spread, so a pair is kept if either the clamped or unclamped bound exceeds -k
+			float ibd0,ibd1,ibd2,ibd3,ks;
+			double sum[2]={0,0},sumsq[2]={0,0};
+			for(size_t g=0;g<sketch.size();g++)
+			{
+			    for(int c=0;c<2;c++)
+			    {
+				sketch[g]->estimateKinship(j1,j2,sketch_counts[g][idx],ibd0,ibd1,ibd2,ibd3,ks,method,c==1);
+				sum[c] += ks;
+				sumsq[c] += ks*ks;
+			    }
+			}
+			double ng = sketch.size();
+			bool keep = false;
+			for(int c=0;c<2;c++)
+			{
+			    double mean = sum[c]/ng;
+			    double se = sqrt(max(0.0,(sumsq[c]-ng*mean*mean)/(ng-1))/ng);
+			    keep = keep || !(mean + sketch_z*se <= min_kin);
+			}
+			npair_screened++;
+			if(keep)
+			{
+			    PairCounts full;
+			    double start = timing ? wall_time() : 0;
+			    K.countPair(j1,j2,full);
+			    if(timing)
+			    {
+				thread_seconds += wall_time()-start;
+			    }
+			    emit(j1,j2,full,out);
+			    npair_kept++;
+			}
+		    }
+		}
+		if(ordered)
+		{
+		    tile_rows[t].push_back(out.size());
+#pragma omp critical(kin_output)
+		    {
+			band_remaining[row0/TILE_SAMPLES]--;
+			while(next_band<nband && band_remaining[next_band]==0)
+			{
+			    size_t first = band_start[next_band];
+			    size_t last = next_band+1<nband ? band_start[next_band+1] : tiles.size();
+			    for(size_t r=0;r+1<tile_rows[first].size();r++)
+			    {
+				for(size_t u=first;u<last;u++)
+				{
+				    text_out.write(tile_out[u].data()+tile_rows[u][r],tile_rows[u][r+1]-tile_rows[u][r]);
+				}
+			    }
+			    for(size_t u=first;u<last;u++)
+			    {
+				string().swap(tile_out[u]);
+				vector<size_t>().swap(tile_rows[u]);
+			    }
+			    next_band++;
+			}
+		    }
+		}
+		else if(buf.size() > OUTPUT_CHUNK)
+		{
+#pragma omp critical(kin_output)
+		    text_out.write(buf.data(),buf.size());
+		    buf.clear();
 		}
 	    }
+	    if(!buf.empty())
+	    {
+#pragma omp critical(kin_output)
+		text_out.write(buf.data(),buf.size());
+	    }
+	    stats.addThreadTime("pairwise",omp_get_thread_num(),thread_seconds);
 	}
+	count_seconds = thread_seconds/nthreads;
     }
 
+    if(binary_out!=NULL)
+    {
+	binary_out->close();
+	delete binary_out;
+    }
+    int nfamily = 0;
+    if(graph_out!=NULL)
+    {
+//every pair within a family is needed to resolve its pedigree, these are
+//computed here for the (few) samples with an edge rather than stored for all pairs
+	nfamily = graph_out->findFamilies();
+	vector< pair<int,int> > rows;
+	for(int f=0;f<nfamily;f++)
+	{
+	    for(size_t a=0;a+1<graph_out->family(f).size();a++)
+	    {
+		rows.push_back(make_pair(f,a));
+	    }
+	}
+	double start = wall_time();
+#pragma omp parallel for schedule(dynamic,1)
+	for(size_t r=0;r<rows.size();r++)
+	{
+	    int f = rows[r].first, a = rows[r].second;
+	    const vector<int> & members = graph_out->family(f);
+	    for(size_t b=a+1;b<members.size();b++)
+	    {
+		float ibd0,ibd1,ibd2,ibd3,ks;
+		K.estimateKinship(members[a],members[b],ibd0,ibd1,ibd2,ibd3,ks,method);
+		graph_out->setFamilyPair(f,a,b,ibd0,ibd1,ibd2,ks,ibd3);
+	    }
+	}
+	count_seconds += wall_time()-start;
+	stats.set("families",nfamily);
+	graph_out->close();
+	delete graph_out;
+    }
+    text_file.close();
     bcf_sr_destroy(sr);	
     cerr << "done."<<endl;
+    if(graph_output)
+    {
+	cerr << nfamily << " families in the graph written to " << output_name << endl;
+    }
+    if(!sketch.empty())
+    {
+	cerr << "Sketch kept "<<npair_kept<<" of "<<npair_screened<<" pairs for the full calculation ("<<npair_screened-npair_kept<<" pruned)"<<endl;
+	for(size_t g=0;g<sketch.size();g++)
+	{
+	    delete sketch[g];
+	}
+    }
+    stats.addTime("pairwise",count_seconds);
+    stats.addTime("output",wall_time()-pairs_start-count_seconds);
+    stats.set("pairs",npair);
+    stats.set("pair_markers_per_second",count_seconds>0 ? (double)npair*K._markers/count_seconds : 0);
+    stats.write();
     return 0;
 }
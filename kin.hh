@@ -4,7 +4,13 @@
 #include "akt.hh"
 #include "logs.hh"
 #include "reader.hh"
-#include <bitset>
+#include "popcount.hh"
+#include "kinfile.hh"
+#include "pipeline.hh"
+#include "gtdecode.hh"
+#include "grm.hh"
+#include "stats.hh"
+#include <string.h>
 #include <iomanip>
 #include <iostream>
 #include <fstream>
@@ -19,30 +25,87 @@
 #include <string>
 #include <math.h>
 
-///Size of bitset. 
-#define  BITSET_SIZE 256
-
 using namespace std;
 
+///samples per side of a tile in the all-pairs loop
+#define TILE_SAMPLES 64
+///blocks streamed per tile pass, 2*TILE_SAMPLES rows of this many blocks are sized to sit in L2
+#define TILE_BLOCKS 16
+
 extern void read_pairs(ifstream &in, vector< pair<string, string> > &relpairs, map<string,int> &name_to_id);
 
 extern void make_pair_list(vector< pair<string, string> > &relpairs, vector<string> names);
 
 //main class for kinship calculations.
 //stores the genotype bitset and relevant counters
+//
+//genotypes are held in one contiguous 64-byte aligned array of uint64 words.
+//each sample owns a row of _stride words made up of BITSET_SIZE-marker blocks,
+//each block is NPLANE planes of BLOCK_WORDS words: [sample][block][plane][word]
+//so a pair of samples is compared by walking two rows linearly.
 class Kinship 
 {
 public:
     Kinship(int nsample);
+    Kinship(const Kinship & src,const vector<int> & blocks);
+    ~Kinship();
     void estimateKinship(int j1,int j2,float & ibd0, float & ibd1, float & ibd2,float & ibd3,float &ks,int method) ;
+    void estimateKinship(int j1,int j2,const PairCounts & counts,float & ibd0, float & ibd1, float & ibd2,float & ibd3,float &ks,int method,bool normalise=true) ;
+    void countTile(int i0,int i1,int j0,int j1,vector<PairCounts> & counts) ;
+    void setMethod(int method,bool pairwise_missing=false);
+    void prepareMissing();
+    void countPair(int j1,int j2,PairCounts & counts) const {_count(row(j1),row(j2),_nblock,counts);};
+    void enableSpill(const string & tmpdir,size_t max_bytes) ;
+    void finishSpill() ;
+    void countSpilled(int i0,int i1,int j0,int j1,vector<PairCounts> & counts,int ldc) ;
+    bool spilled() const {return _spill_fd>=0;};
     void estimateIBD(float & ibd0, float & ibd1, float & ibd2,float & ibd3,bool normalise=true) ;
+    void estimateIBD(const float *n,float & ibd0, float & ibd1, float & ibd2,float & ibd3,bool normalise=true) ;
     void addGenotypes(int *gt_arr,float p);
+    void addGenotypes(const uint8_t * const *codes,const float *ps,const int *ac,const int *an,int n);
     void addGenotypes(int *gt_arr);
+    void saveState(const string & filename,const vector<string> & names,const vector<string> & sites,bool fixed_af) const;
+    int loadState(const string & filename,vector<string> & names,vector<string> & sites,bool & fixed_af);
+    void setGenotypes(int marker,int first,const uint8_t *codes,const GtCounts & counts);
+    void updateFrequencies(bool fixed_af);
     float _n00,_n10,_n11,_n20,_n21,_n22;
     int _nsample,_markers,_bc;  
     vector<float> _af;//allele freqs
-    vector< vector< vector< bitset<BITSET_SIZE> > > > _bits; ///[sample][site][type][val]
+    vector<int> _ac,_an;//alternate/called allele counts per marker, kept so frequencies can be updated
     vector<float> _lookup;
+
+    int nblock() const {return _nblock;};
+    ///first word of sample j's genotype row (in memory mode)
+    const uint64_t *row(int j) const {return _bits + (size_t)j*_stride;};
+private:
+    Kinship(const Kinship &);
+    Kinship & operator=(const Kinship &);
+    void addBlock();
+    void addMoments(float p);
+    void countHets();
+    void pairMoments(int j1,int j2,const PairCounts & counts,float *n) const;
+    void writeChunk();
+    void readChunk(int k,int s0,int s1,uint64_t *dst) const;
+    int residentBlocks() const {return _nblock - _nchunk*_chunk_blocks;};
+    uint64_t *_bits; ///[sample][block][type][word]
+    size_t _stride; ///words per sample row
+    int _nblock,_capacity; ///blocks used/allocated per sample
+
+    //out-of-core mode. _bits only holds the latest _chunk_blocks blocks and full
+    //chunks are appended to an unlinked temporary file, chunk-major then sample-major.
+    int _spill_fd;
+    int _chunk_blocks,_nchunk;
+    pair_counter _count; ///popcount kernel for this CPU
+    vector<int> _nhet; ///heterozygous markers per sample
+
+    //--pairwise-missing. the moments are taken over the markers called in both samples,
+    //the sums over each sample's missing markers (and over every genotype word) are
+    //precomputed so a pair only has to visit the words missing in both.
+    bool _pairwise_missing;
+    vector<float> _marker_moments; ///n00,n10,n11,n20,n21 of each marker
+    vector<double> _word_moments; ///the same summed over the 64 markers of each word
+    vector<double> _miss_moments; ///the same summed over the missing markers of each sample
+    vector<int> _nmiss; ///missing markers per sample
 };
 
 #endif
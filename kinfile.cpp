@@ -0,0 +1,559 @@
+/**
+ * @file   kinfile.cpp
+ * @brief  Binary kinship matrix reader/writer.
+ *
+ * A header with the sample names followed by one upper-triangular array per
+ * statistic. Both sides memory map the file so neither holds a copy of the
+ * N(N-1)/2 pairs.
+ *
+ * The graph file (-O g) only holds the pairs above a threshold plus every pair
+ * within each connected component, so it is small and read into memory.
+ */
+
+#include "kinfile.hh"
+#include "utils.hh"
+
+#include <string.h>
+#include <assert.h>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+static size_t pad64(size_t n)
+{
+    return (n+63)/64*64;
+}
+
+///header bytes before the names
+#define KINFILE_HEADER (8+4+4+8)
+
+uint16_t float_to_half(float x)
+{
+    uint32_t f;
+    memcpy(&f,&x,4);
+    uint32_t sign = (f>>16) & 0x8000;
+    uint32_t fexp = (f>>23) & 0xff;
+    uint32_t mant = f & 0x7fffff;
+    if(fexp==0xff)//inf/nan
+    {
+	return sign | 0x7c00 | (mant ? 0x200 : 0);
+    }
+    int exp = (int)fexp - 127 + 15;
+    if(exp >= 0x1f)//overflow
+    {
+	return sign | 0x7c00;
+    }
+    if(exp <= 0)//subnormal
+    {
+	if(exp < -10)
+	{
+	    return sign;
+	}
+	mant |= 0x800000;
+	int shift = 14 - exp;
+	uint32_t h = mant >> shift;
+	uint32_t rem = mant & ((1u<<shift)-1), half = 1u<<(shift-1);
+	if(rem>half || (rem==half && (h&1)))
+	{
+	    h++;
+	}
+	return sign | h;
+    }
+    uint32_t h = ((uint32_t)exp<<10) | (mant>>13);
+    uint32_t rem = mant & 0x1fff;
+    if(rem>0x1000 || (rem==0x1000 && (h&1)))//round to nearest even, may carry into the exponent
+    {
+	h++;
+    }
+    return sign | h;
+}
+
+float half_to_float(uint16_t h)
+{
+    uint32_t sign = (uint32_t)(h&0x8000) << 16;
+    int exp = (h>>10) & 0x1f;
+    uint32_t mant = h & 0x3ff;
+    uint32_t f;
+    if(exp==0)
+    {
+	if(mant==0)
+	{
+	    f = sign;
+	}
+	else//subnormal
+	{
+	    exp = 1;
+	    while(!(mant&0x400))
+	    {
+		mant <<= 1;
+		exp--;
+	    }
+	    mant &= 0x3ff;
+	    f = sign | ((uint32_t)(exp+127-15)<<23) | (mant<<13);
+	}
+    }
+    else if(exp==0x1f)
+    {
+	f = sign | 0x7f800000 | (mant<<13);
+    }
+    else
+    {
+	f = sign | ((uint32_t)(exp+127-15)<<23) | (mant<<13);
+    }
+    float x;
+    memcpy(&x,&f,4);
+    return x;
+}
+
+KinshipFileWriter::KinshipFileWriter(const string & filename,const vector<string> & names,KinValueType type)
+{
+    _filename = filename;
+    _nsample = names.size();
+    _type = type;
+    size_t npair = _nsample*(_nsample-1)/2;
+    size_t name_bytes = 0;
+    for(size_t i=0;i<names.size();i++)
+    {
+	name_bytes += names[i].size()+1;
+    }
+    size_t value_size = type==KIN_FLOAT16 ? 2 : 4;
+    size_t offset = pad64(KINFILE_HEADER+name_bytes);
+    _size = offset + 4*pad64(npair*value_size) + pad64(npair*4);
+
+    int fd = open(filename.c_str(),O_RDWR|O_CREAT|O_TRUNC,0666);
+    if(fd<0)
+    {
+	die("could not open "+filename+" for writing");
+    }
+    if(ftruncate(fd,_size)!=0)
+    {
+	die("could not allocate "+to_string(_size)+" bytes for "+filename);
+    }
+    _data = (char *)mmap(NULL,_size,PROT_READ|PROT_WRITE,MAP_SHARED,fd,0);
+    ::close(fd);
+    if(_data==MAP_FAILED)
+    {
+	die("could not memory map "+filename);
+    }
+
+    uint32_t n32 = _nsample, t32 = type;
+    uint64_t nb64 = name_bytes;
+    memcpy(_data,KINFILE_MAGIC,8);
+    memcpy(_data+8,&n32,4);
+    memcpy(_data+12,&t32,4);
+    memcpy(_data+16,&nb64,8);
+    char *p = _data+KINFILE_HEADER;
+    for(size_t i=0;i<names.size();i++)
+    {
+	memcpy(p,names[i].c_str(),names[i].size()+1);
+	p += names[i].size()+1;
+    }
+    for(int s=0;s<4;s++)
+    {
+	_stat[s] = _data + offset + s*pad64(npair*value_size);
+    }
+    _stat[KIN_NSNP] = _data + offset + 4*pad64(npair*value_size);
+}
+
+void KinshipFileWriter::set(int i,int j,float ibd0,float ibd1,float ibd2,float ks,float nsnp)
+{
+    size_t idx = kinfile_pair_index(_nsample,i,j);
+    float v[4] = {ibd0,ibd1,ibd2,ks};
+    for(int s=0;s<4;s++)
+    {
+	if(_type==KIN_FLOAT16)
+	{
+	    ((uint16_t *)_stat[s])[idx] = float_to_half(v[s]);
+	}
+	else
+	{
+	    ((float *)_stat[s])[idx] = v[s];
+	}
+    }
+    ((uint32_t *)_stat[KIN_NSNP])[idx] = (uint32_t)nsnp;
+}
+
+void KinshipFileWriter::close()
+{
+    if(_data!=NULL)
+    {
+	if(munmap(_data,_size)!=0)
+	{
+	    die("problem writing "+_filename);
+	}
+	_data = NULL;
+    }
+}
+
+KinshipFileWriter::~KinshipFileWriter()
+{
+    close();
+}
+
+bool KinshipFile::is_kinship_file(const string & filename)
+{
+    char magic[8];
+    FILE *fp = fopen(filename.c_str(),"rb");
+    if(fp==NULL)
+    {
+	return false;
+    }
+    bool ret = fread(magic,1,8,fp)==8 && memcmp(magic,KINFILE_MAGIC,8)==0;
+    fclose(fp);
+    return ret;
+}
+
+KinshipFile::KinshipFile(const string & filename)
+{
+    int fd = open(filename.c_str(),O_RDONLY);
+    if(fd<0)
+    {
+	die("could not open "+filename);
+    }
+    struct stat st;
+    if(fstat(fd,&st)!=0 || st.st_size < KINFILE_HEADER)
+    {
+	die(filename+" is not an akt kin binary file");
+    }
+    _size = st.st_size;
+    _data = (char *)mmap(NULL,_size,PROT_READ,MAP_SHARED,fd,0);
+    ::close(fd);
+    if(_data==MAP_FAILED)
+    {
+	die("could not memory map "+filename);
+    }
+    if(memcmp(_data,KINFILE_MAGIC,8)!=0)
+    {
+	die(filename+" is not an akt kin binary file");
+    }
+    uint32_t n32,t32;
+    uint64_t name_bytes;
+    memcpy(&n32,_data+8,4);
+    memcpy(&t32,_data+12,4);
+    memcpy(&name_bytes,_data+16,8);
+    _nsample = n32;
+    _type = (KinValueType)t32;
+    _npair = _nsample*(_nsample-1)/2;
+    size_t value_size = _type==KIN_FLOAT16 ? 2 : 4;
+    size_t offset = pad64(KINFILE_HEADER+name_bytes);
+    if(_type>KIN_FLOAT16 || _size < offset + 4*pad64(_npair*value_size) + pad64(_npair*4))
+    {
+	die(filename+" is truncated or corrupt");
+    }
+    const char *p = _data+KINFILE_HEADER, *end = p+name_bytes;
+    while(p<end && _names.size()<_nsample)
+    {
+	_names.push_back(string(p));
+	p += _names.back().size()+1;
+    }
+    if(_names.size()!=_nsample)
+    {
+	die(filename+" is truncated or corrupt");
+    }
+    for(int s=0;s<4;s++)
+    {
+	_stat[s] = _data + offset + s*pad64(_npair*value_size);
+    }
+    _stat[KIN_NSNP] = _data + offset + 4*pad64(_npair*value_size);
+}
+
+KinshipFile::~KinshipFile()
+{
+    munmap(_data,_size);
+}
+
+float KinshipFile::value(KinStat stat,size_t idx) const
+{
+    if(stat==KIN_NSNP)
+    {
+	return (float)((const uint32_t *)_stat[KIN_NSNP])[idx];
+    }
+    if(_type==KIN_FLOAT16)
+    {
+	return half_to_float(((const uint16_t *)_stat[stat])[idx]);
+    }
+    return ((const float *)_stat[stat])[idx];
+}
+
+static void write_bytes(FILE *fp,const void *p,size_t n,const string & filename)
+{
+    if(n>0 && fwrite(p,1,n,fp)!=n)
+    {
+	die("problem writing "+filename);
+    }
+}
+
+static void read_bytes(FILE *fp,void *p,size_t n,const string & filename)
+{
+    if(n>0 && fread(p,1,n,fp)!=n)
+    {
+	die(filename+" is truncated or corrupt");
+    }
+}
+
+void KinPairArray::resize(size_t npair)
+{
+    for(int s=0;s<4;s++)
+    {
+	_stat[s].resize(npair);
+    }
+    _nsnp.resize(npair);
+}
+
+void KinPairArray::set(size_t idx,float ibd0,float ibd1,float ibd2,float ks,float nsnp)
+{
+    _stat[KIN_IBD0][idx] = ibd0;
+    _stat[KIN_IBD1][idx] = ibd1;
+    _stat[KIN_IBD2][idx] = ibd2;
+    _stat[KIN_KINSHIP][idx] = ks;
+    _nsnp[idx] = (uint32_t)nsnp;
+}
+
+void KinPairArray::write(FILE *fp,const string & filename) const
+{
+    for(int s=0;s<4;s++)
+    {
+	write_bytes(fp,_stat[s].data(),_stat[s].size()*sizeof(float),filename);
+    }
+    write_bytes(fp,_nsnp.data(),_nsnp.size()*sizeof(uint32_t),filename);
+}
+
+///reads size() pairs, resize() first
+void KinPairArray::read(FILE *fp,const string & filename)
+{
+    for(int s=0;s<4;s++)
+    {
+	read_bytes(fp,_stat[s].data(),_stat[s].size()*sizeof(float),filename);
+    }
+    read_bytes(fp,_nsnp.data(),_nsnp.size()*sizeof(uint32_t),filename);
+}
+
+KinshipGraphWriter::KinshipGraphWriter(const string & filename,const vector<string> & names,float threshold,int nthreads)
+{
+    _filename = filename;
+    _names = names;
+    _threshold = threshold;
+    _thread_edges.resize(max(1,nthreads));
+}
+
+void KinshipGraphWriter::add(int thread,int i,int j,float ibd0,float ibd1,float ibd2,float ks,float nsnp)
+{
+    Edge e = {min(i,j),max(i,j),ibd0,ibd1,ibd2,ks,nsnp};
+    _thread_edges[thread].push_back(e);
+}
+
+static int find_root(vector<int> & parent,int i)
+{
+    while(parent[i]!=i)
+    {
+	parent[i] = parent[parent[i]];
+	i = parent[i];
+    }
+    return i;
+}
+
+/**
+ * @name    findFamilies
+ * @brief   merge the per-thread edges into the CSR adjacency and find its connected components
+ *
+ * Families are ordered by their first member and their members are ascending.
+ */
+int KinshipGraphWriter::findFamilies()
+{
+    size_t nsample = _names.size();
+    vector<Edge> edges;
+    for(size_t t=0;t<_thread_edges.size();t++)
+    {
+	edges.insert(edges.end(),_thread_edges[t].begin(),_thread_edges[t].end());
+	vector<Edge>().swap(_thread_edges[t]);
+    }
+    sort(edges.begin(),edges.end());
+
+    _rows.assign(nsample+1,0);
+    _columns.resize(edges.size());
+    _edges.resize(edges.size());
+    vector<int> parent(nsample);
+    for(size_t i=0;i<nsample;i++)
+    {
+	parent[i] = i;
+    }
+    for(size_t e=0;e<edges.size();e++)
+    {
+	_rows[edges[e].i+1]++;
+	_columns[e] = edges[e].j;
+	_edges.set(e,edges[e].ibd0,edges[e].ibd1,edges[e].ibd2,edges[e].ks,edges[e].nsnp);
+	int a = find_root(parent,edges[e].i), b = find_root(parent,edges[e].j);
+	parent[max(a,b)] = min(a,b);
+    }
+    for(size_t i=0;i<nsample;i++)
+    {
+	_rows[i+1] += _rows[i];
+    }
+
+//roots are the smallest member of each component, so visiting samples in order gives sorted families
+    vector<int> label(nsample,-1),size(nsample,0);
+    for(size_t i=0;i<nsample;i++)
+    {
+	size[find_root(parent,i)]++;
+    }
+    for(size_t i=0;i<nsample;i++)
+    {
+	int root = find_root(parent,i);
+	if(size[root]>1)
+	{
+	    if(label[root]<0)
+	    {
+		label[root] = _families.size();
+		_families.push_back(vector<int>());
+	    }
+	    _families[label[root]].push_back(i);
+	}
+    }
+    _family_pairs.resize(_families.size());
+    for(size_t f=0;f<_families.size();f++)
+    {
+	size_t s = _families[f].size();
+	_family_pairs[f].resize(s*(s-1)/2);
+    }
+    return _families.size();
+}
+
+void KinshipGraphWriter::setFamilyPair(int f,int a,int b,float ibd0,float ibd1,float ibd2,float ks,float nsnp)
+{
+    _family_pairs[f].set(kinfile_pair_index(_families[f].size(),a,b),ibd0,ibd1,ibd2,ks,nsnp);
+}
+
+void KinshipGraphWriter::close()
+{
+    FILE *fp = fopen(_filename.c_str(),"wb");
+    if(fp==NULL)
+    {
+	die("could not open "+_filename+" for writing");
+    }
+    uint32_t n32 = _names.size();
+    uint64_t name_bytes = 0;
+    for(size_t i=0;i<_names.size();i++)
+    {
+	name_bytes += _names[i].size()+1;
+    }
+    write_bytes(fp,KINGRAPH_MAGIC,8,_filename);
+    write_bytes(fp,&n32,4,_filename);
+    write_bytes(fp,&_threshold,4,_filename);
+    write_bytes(fp,&name_bytes,8,_filename);
+    for(size_t i=0;i<_names.size();i++)
+    {
+	write_bytes(fp,_names[i].c_str(),_names[i].size()+1,_filename);
+    }
+    uint64_t nedge = _columns.size();
+    write_bytes(fp,&nedge,8,_filename);
+    write_bytes(fp,_rows.data(),_rows.size()*sizeof(uint64_t),_filename);
+    write_bytes(fp,_columns.data(),_columns.size()*sizeof(uint32_t),_filename);
+    _edges.write(fp,_filename);
+    uint32_t nfamily = _families.size();
+    write_bytes(fp,&nfamily,4,_filename);
+    for(size_t f=0;f<_families.size();f++)
+    {
+	uint32_t s = _families[f].size();
+	vector<uint32_t> members(_families[f].begin(),_families[f].end());
+	write_bytes(fp,&s,4,_filename);
+	write_bytes(fp,members.data(),s*sizeof(uint32_t),_filename);
+	_family_pairs[f].write(fp,_filename);
+    }
+    if(fclose(fp)!=0)
+    {
+	die("problem writing "+_filename);
+    }
+}
+
+bool KinshipGraph::is_graph_file(const string & filename)
+{
+    char magic[8];
+    FILE *fp = fopen(filename.c_str(),"rb");
+    if(fp==NULL)
+    {
+	return false;
+    }
+    bool ret = fread(magic,1,8,fp)==8 && memcmp(magic,KINGRAPH_MAGIC,8)==0;
+    fclose(fp);
+    return ret;
+}
+
+KinshipGraph::KinshipGraph(const string & filename)
+{
+    FILE *fp = fopen(filename.c_str(),"rb");
+    if(fp==NULL)
+    {
+	die("could not open "+filename);
+    }
+    char magic[8];
+    uint32_t n32;
+    uint64_t name_bytes,nedge;
+    read_bytes(fp,magic,8,filename);
+    if(memcmp(magic,KINGRAPH_MAGIC,8)!=0)
+    {
+	die(filename+" is not an akt kin graph file");
+    }
+    read_bytes(fp,&n32,4,filename);
+    read_bytes(fp,&_threshold,4,filename);
+    read_bytes(fp,&name_bytes,8,filename);
+    vector<char> name_data(name_bytes+1,0);
+    read_bytes(fp,name_data.data(),name_bytes,filename);
+    for(size_t p=0;p<name_bytes && _names.size()<n32;p+=_names.back().size()+1)
+    {
+	_names.push_back(string(&name_data[p]));
+    }
+    if(_names.size()!=n32)
+    {
+	die(filename+" is truncated or corrupt");
+    }
+
+    read_bytes(fp,&nedge,8,filename);
+    _rows.resize(n32+1);
+    read_bytes(fp,_rows.data(),_rows.size()*sizeof(uint64_t),filename);
+    if(_rows.back()!=nedge)
+    {
+	die(filename+" is truncated or corrupt");
+    }
+    _columns.resize(nedge);
+    read_bytes(fp,_columns.data(),nedge*sizeof(uint32_t),filename);
+    _edges.resize(nedge);
+    _edges.read(fp,filename);
+
+    uint32_t nfamily;
+    read_bytes(fp,&nfamily,4,filename);
+    _families.resize(nfamily);
+    _family_pairs.resize(nfamily);
+    _family.assign(n32,-1);
+    _position.assign(n32,-1);
+    for(size_t f=0;f<nfamily;f++)
+    {
+	uint32_t s;
+	read_bytes(fp,&s,4,filename);
+	vector<uint32_t> members(s);
+	read_bytes(fp,members.data(),s*sizeof(uint32_t),filename);
+	for(size_t a=0;a<s;a++)
+	{
+	    if(members[a]>=n32)
+	    {
+		die(filename+" is truncated or corrupt");
+	    }
+	    _family[members[a]] = f;
+	    _position[members[a]] = a;
+	}
+	_families[f].assign(members.begin(),members.end());
+	_family_pairs[f].resize((size_t)s*(s-1)/2);
+	_family_pairs[f].read(fp,filename);
+    }
+    fclose(fp);
+}
+
+float KinshipGraph::get(KinStat stat,int i,int j) const
+{
+    int f = _family[i];
+    assert(f>=0 && f==_family[j] && i<j);
+    return _family_pairs[f].value(stat,kinfile_pair_index(_families[f].size(),_position[i],_position[j]));
+}
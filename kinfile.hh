@@ -0,0 +1,184 @@
+#ifndef AKT_KINFILE_H
+#define AKT_KINFILE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+//Binary output for akt kin.
+//
+//layout (native byte order):
+//  char[8]  magic "AKTKIN01"
+//  uint32   nsample
+//  uint32   value type of the statistics 0=float32 1=float16
+//  uint64   bytes of sample names (NUL terminated, in sample order)
+//  names, zero padded to a multiple of 64 bytes
+//  IBD0,IBD1,IBD2,KINSHIP arrays followed by a uint32 NSNP array.
+//  each array holds the N(N-1)/2 pairs i<j of the upper triangle in row order
+//  and is zero padded to a multiple of 64 bytes.
+
+#define KINFILE_MAGIC "AKTKIN01"
+
+enum KinStat {KIN_IBD0=0, KIN_IBD1=1, KIN_IBD2=2, KIN_KINSHIP=3, KIN_NSNP=4};
+
+enum KinValueType {KIN_FLOAT32=0, KIN_FLOAT16=1};
+
+//index of the pair (i,j) i<j within a triangle array
+inline size_t kinfile_pair_index(size_t nsample,size_t i,size_t j)
+{
+    return i*(2*nsample-i-1)/2 + (j-i-1);
+}
+
+uint16_t float_to_half(float x);
+float half_to_float(uint16_t h);
+
+//memory maps a new kinship file. set() may be called concurrently for different pairs.
+class KinshipFileWriter
+{
+public:
+    KinshipFileWriter(const std::string & filename,const std::vector<std::string> & names,KinValueType type);
+    ~KinshipFileWriter();
+    void set(int i,int j,float ibd0,float ibd1,float ibd2,float ks,float nsnp);
+    void close();
+private:
+    KinshipFileWriter(const KinshipFileWriter &);
+    KinshipFileWriter & operator=(const KinshipFileWriter &);
+    std::string _filename;
+    size_t _nsample,_size;
+    KinValueType _type;
+    char *_data;
+    char *_stat[5];
+};
+
+//read-only memory mapped view of a kinship file
+class KinshipFile
+{
+public:
+    KinshipFile(const std::string & filename);
+    ~KinshipFile();
+    //true if filename starts with the kinship file magic
+    static bool is_kinship_file(const std::string & filename);
+    int nsample() const {return (int)_nsample;};
+    size_t npair() const {return _npair;};
+    const std::string & name(int i) const {return _names[i];};
+    const std::vector<std::string> & names() const {return _names;};
+    float get(KinStat stat,int i,int j) const {return value(stat,kinfile_pair_index(_nsample,i,j));};
+    //value of the idx'th pair in triangle order
+    float value(KinStat stat,size_t idx) const;
+private:
+    KinshipFile(const KinshipFile &);
+    KinshipFile & operator=(const KinshipFile &);
+    size_t _nsample,_npair,_size;
+    KinValueType _type;
+    std::vector<std::string> _names;
+    char *_data;
+    const char *_stat[5];
+};
+
+//Sparse relationship graph output for akt kin (-O g).
+//
+//layout (native byte order, no padding):
+//  char[8]  magic "AKTGRF01"
+//  uint32   nsample
+//  float32  kinship threshold of the edges
+//  uint64   bytes of sample names (NUL terminated, in sample order)
+//  names
+//  uint64   number of edges E
+//  uint64   CSR row offsets, N+1 of them. row i holds the pairs (i,j) j>i with KINSHIP above the threshold
+//  uint32   column j of each edge
+//  IBD0,IBD1,IBD2,KINSHIP float32 arrays followed by a uint32 NSNP array over the E edges.
+//  uint32   number of families F
+//  for each family
+//    uint32   size S
+//    uint32   members, ascending
+//    IBD0,IBD1,IBD2,KINSHIP float32 arrays followed by a uint32 NSNP array over the
+//    S(S-1)/2 pairs of members in triangle order.
+//
+//families are the connected components of the edges. every pair inside a family is
+//stored, including those below the threshold, so pedigrees can be resolved without
+//the all-vs-all matrix.
+
+#define KINGRAPH_MAGIC "AKTGRF01"
+
+//statistics of a list of pairs
+class KinPairArray
+{
+public:
+    void resize(size_t npair);
+    size_t size() const {return _nsnp.size();};
+    void set(size_t idx,float ibd0,float ibd1,float ibd2,float ks,float nsnp);
+    float value(KinStat stat,size_t idx) const {return stat==KIN_NSNP ? (float)_nsnp[idx] : _stat[stat][idx];};
+    void write(FILE *fp,const std::string & filename) const;
+    void read(FILE *fp,const std::string & filename);
+private:
+    std::vector<float> _stat[4];
+    std::vector<uint32_t> _nsnp;
+};
+
+//collects the edges of a kinship graph, finds its families and writes it on close()
+class KinshipGraphWriter
+{
+public:
+    KinshipGraphWriter(const std::string & filename,const std::vector<std::string> & names,float threshold,int nthreads);
+    //edges are kept per thread, so add() may be called concurrently with different threads
+    void add(int thread,int i,int j,float ibd0,float ibd1,float ibd2,float ks,float nsnp);
+    //builds the adjacency and returns the number of families, call once every edge is added
+    int findFamilies();
+    const std::vector<int> & family(int f) const {return _families[f];};
+    //sets the pair of the a'th and b'th members (a<b) of family f, may be called concurrently
+    void setFamilyPair(int f,int a,int b,float ibd0,float ibd1,float ibd2,float ks,float nsnp);
+    void close();
+private:
+    struct Edge
+    {
+	int i,j;
+	float ibd0,ibd1,ibd2,ks,nsnp;
+	bool operator<(const Edge & e) const {return i<e.i || (i==e.i && j<e.j);};
+    };
+    std::string _filename;
+    std::vector<std::string> _names;
+    float _threshold;
+    std::vector< std::vector<Edge> > _thread_edges;
+    std::vector<uint64_t> _rows;
+    std::vector<uint32_t> _columns;
+    KinPairArray _edges;
+    std::vector< std::vector<int> > _families;
+    std::vector<KinPairArray> _family_pairs;
+};
+
+//a kinship graph read into memory
+class KinshipGraph
+{
+public:
+    KinshipGraph(const std::string & filename);
+    //true if filename starts with the kinship graph magic
+    static bool is_graph_file(const std::string & filename);
+    int nsample() const {return (int)_names.size();};
+    float threshold() const {return _threshold;};
+    const std::string & name(int i) const {return _names[i];};
+    const std::vector<std::string> & names() const {return _names;};
+    //edges of sample i are [row_begin(i),row_end(i))
+    size_t row_begin(int i) const {return _rows[i];};
+    size_t row_end(int i) const {return _rows[i+1];};
+    int column(size_t e) const {return _columns[e];};
+    float edge(KinStat stat,size_t e) const {return _edges.value(stat,e);};
+    int nfamily() const {return (int)_families.size();};
+    //family of sample i (-1 if it has no edges) and its position among the members
+    int family_of(int i) const {return _family[i];};
+    int position(int i) const {return _position[i];};
+    //statistic of the pair of samples i<j in the same family
+    float get(KinStat stat,int i,int j) const;
+private:
+    float _threshold;
+    std::vector<std::string> _names;
+    std::vector<uint64_t> _rows;
+    std::vector<uint32_t> _columns;
+    KinPairArray _edges;
+    std::vector< std::vector<int> > _families;
+    std::vector<KinPairArray> _family_pairs;
+    std::vector<int> _family,_position;
+};
+
+#endif //AKT_KINFILE_H
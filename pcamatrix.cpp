@@ -0,0 +1,301 @@
+/**
+ * @file   pcamatrix.cpp
+ * @brief  2 bit packed genotype matrix for akt pca --packed.
+ *
+ * Only the packed dosages and two floats per marker are kept. The standardised
+ * value of a genotype g at marker m is (g - mean_m) * scale_m, or 0 if missing.
+ * The products split this into the value of a homozygous reference genotype,
+ * which is the same for every sample and applied once, plus an offset for the
+ * other genotypes. Homozygous reference genotypes, the bulk of the matrix, then
+ * cost a zero test on their byte.
+ *
+ * PcaProjection does the opposite product for akt pca -W, samples times
+ * precomputed loadings, a block of sites at a time, and correct_shrinkage
+ * adjusts its result for akt pca -W -F.
+ */
+
+#include "pcamatrix.hh"
+#include "gtdecode.hh"
+
+#include <string.h>
+
+using namespace std;
+
+PackedGenotypeMatrix::PackedGenotypeMatrix(int nsample,int covn)
+{
+    _nsample = nsample;
+    _nmarker = 0;
+    _covn = covn;
+    _stride = (nsample+3)/4;
+}
+
+void PackedGenotypeMatrix::resize(int nmarker)
+{
+    _nmarker = nmarker;
+    _packed.resize(_stride*nmarker);
+    _mean.resize(nmarker);
+    _scale.resize(nmarker);
+}
+
+float PackedGenotypeMatrix::setMarker(int m,const uint8_t *codes)
+{
+    assert(m<_nmarker);
+    uint8_t *p = &_packed[_stride*m];
+    memset(p,0,_stride);
+    int sum = 0,ncalled = 0;
+    for(int i=0; i<_nsample; i++)
+    {
+	uint8_t g = codes[i];
+	if(g<=2)
+	{
+	    sum += g;
+	    ncalled++;
+	}
+	else
+	{
+	    g = 3;
+	}
+	p[i>>2] |= g << (2*(i&3));
+    }
+    //missing genotypes are filled with the mean, so they are 0 once centred
+    float mu = ncalled>0 ? (float)sum/(float)ncalled : 0;
+    _mean[m] = mu;
+    _scale[m] = 1;
+    if(_covn == 1)
+    {
+	float p = 0.5 * mu;
+	_scale[m] = 1 / sqrt(2 * p * (1-p));
+    }
+    return mu;
+}
+
+///offsets of genotypes 1, 2 and missing (d[1..3]) from the standardised value of genotype 0 (d[0])
+void PackedGenotypeMatrix::offsets(int m,float *d) const
+{
+    d[0] = -_mean[m] * _scale[m];
+    d[1] = _scale[m];
+    d[2] = 2 * _scale[m];
+    d[3] = _mean[m] * _scale[m];
+}
+
+/**
+ * @name    multiply
+ * @brief   out = A * R without forming A
+ *
+ * Row i of out is sum_m A(i,m) R(m,:). The d[0] terms give the same row for every
+ * sample, the rest are added a tile of samples at a time so the tile's rows of
+ * out stay in cache while the markers stream past. Tiles are shared between threads.
+ */
+void PackedGenotypeMatrix::multiply(const Eigen::MatrixXf & R,Eigen::MatrixXf & out) const
+{
+    assert(R.rows()==_nmarker);
+    int k = R.cols();
+    RowMatrixXf Rr = R; ///rows of R contiguous
+    vector<float> d(4*_nmarker);
+    Eigen::RowVectorXf base = Eigen::RowVectorXf::Zero(k);
+    for(int m=0; m<_nmarker; m++)
+    {
+	offsets(m,&d[4*m]);
+	base.noalias() += d[4*m] * Rr.row(m);
+    }
+    out.resize(_nsample,k);
+#pragma omp parallel for schedule(dynamic,1)
+    for(int i0=0; i0<_nsample; i0+=PCA_SAMPLE_TILE)
+    {
+	int ni = min(PCA_SAMPLE_TILE,_nsample-i0);
+	int nbyte = (ni+3)/4;
+	RowMatrixXf acc = RowMatrixXf::Zero(PCA_SAMPLE_TILE,k);
+	for(int m=0; m<_nmarker; m++)
+	{
+	    const uint8_t *p = &_packed[_stride*m + i0/4];
+	    const float *dm = &d[4*m];
+	    Eigen::Map<const Eigen::RowVectorXf> rm(&Rr(m,0),k);
+	    for(int j=0; j<nbyte; j++)
+	    {
+		uint8_t b = p[j];
+		for(int s=0; b!=0; s++,b>>=2)
+		{
+		    int c = b&3;
+		    if(c)
+		    {
+			acc.row(4*j+s).noalias() += dm[c] * rm;
+		    }
+		}
+	    }
+	}
+	for(int i=0; i<ni; i++)
+	{
+	    out.row(i0+i) = acc.row(i) + base;
+	}
+    }
+}
+
+/**
+ * @name    transposeMultiply
+ * @brief   out = A^T * Y without forming A
+ *
+ * Row m of out is d[0] times the column sums of Y plus the offset of each
+ * non-reference genotype times its row of Y. A block of markers is accumulated
+ * one tile of samples at a time so the rows of Y are reused across the block.
+ * Blocks are shared between threads.
+ */
+void PackedGenotypeMatrix::transposeMultiply(const Eigen::MatrixXf & Y,Eigen::MatrixXf & out) const
+{
+    assert(Y.rows()==_nsample);
+    int k = Y.cols();
+    RowMatrixXf Yr = Y; ///rows of Y contiguous
+    Eigen::RowVectorXf ysum = Y.colwise().sum();
+    out.resize(_nmarker,k);
+#pragma omp parallel for schedule(dynamic,1)
+    for(int m0=0; m0<_nmarker; m0+=PCA_MARKER_BLOCK)
+    {
+	int nm = min(PCA_MARKER_BLOCK,_nmarker-m0);
+	RowMatrixXf acc(PCA_MARKER_BLOCK,k);
+	float d[PCA_MARKER_BLOCK][4];
+	for(int m=0; m<nm; m++)
+	{
+	    offsets(m0+m,d[m]);
+	    acc.row(m) = d[m][0] * ysum;
+	}
+	for(int i0=0; i0<_nsample; i0+=PCA_SAMPLE_TILE)
+	{
+	    int nbyte = (min(PCA_SAMPLE_TILE,_nsample-i0)+3)/4;
+	    for(int m=0; m<nm; m++)
+	    {
+		const uint8_t *p = &_packed[_stride*(m0+m) + i0/4];
+		for(int j=0; j<nbyte; j++)
+		{
+		    uint8_t b = p[j];
+		    for(int s=0; b!=0; s++,b>>=2)
+		    {
+			int c = b&3;
+			if(c)
+			{
+			    acc.row(m).noalias() += d[m][c] * Yr.row(i0+4*j+s);
+			}
+		    }
+		}
+	    }
+	}
+	out.middleRows(m0,nm) = acc.topRows(nm);
+    }
+}
+
+PcaProjection::PcaProjection(int nsample,int npc,bool assume_homref)
+{
+    _npc = npc;
+    _assume_homref = assume_homref;
+    _weights.resize(PCA_PROJECT_BLOCK,npc);
+    reset(nsample);
+}
+
+void PcaProjection::reset(int nsample)
+{
+    _nsample = nsample;
+    _nsite = 0;
+    _codes.resize((size_t)nsample*PCA_PROJECT_BLOCK);
+    _pc.setZero(nsample,_npc);
+    _norm2.setZero(nsample);
+}
+
+void PcaProjection::addSite(const uint8_t *codes,float af,const float *weights)
+{
+    uint8_t *dst = &_codes[(size_t)_nsite*_nsample];
+    if(codes!=NULL)
+    {
+	memcpy(dst,codes,_nsample);
+    }
+    else
+    {
+	memset(dst,GT_MISSING,_nsample);
+    }
+    float mean = 2*af, scale = 1/sqrt(2*af*(1-af));
+    for(int g=0; g<3; g++)
+    {
+	_value[_nsite][g] = (g - mean) * scale;
+    }
+    _value[_nsite][3] = _assume_homref ? _value[_nsite][0] : 0;
+    for(int i=0; i<_npc; i++)
+    {
+	_weights(_nsite,i) = weights[i];
+    }
+    if(++_nsite == PCA_PROJECT_BLOCK)
+    {
+	flush();
+    }
+}
+
+void PcaProjection::flush()
+{
+    if(_nsite == 0)
+    {
+	return;
+    }
+#pragma omp parallel for schedule(dynamic,1)
+    for(int i0=0; i0<_nsample; i0+=PCA_SAMPLE_TILE)
+    {
+	int ni = min(PCA_SAMPLE_TILE,_nsample-i0);
+	Eigen::MatrixXf z(ni,_nsite);
+	for(int s=0; s<_nsite; s++)
+	{
+	    const uint8_t *code = &_codes[(size_t)s*_nsample + i0];
+	    for(int i=0; i<ni; i++)
+	    {
+		z(i,s) = _value[s][code[i]<=2 ? code[i] : 3];
+	    }
+	}
+	_pc.middleRows(i0,ni).noalias() += z * _weights.topRows(_nsite);
+	_norm2.segment(i0,ni) += z.rowwise().squaredNorm();
+    }
+    _nsite = 0;
+}
+
+const Eigen::MatrixXf & PcaProjection::finish()
+{
+    flush();
+    return _pc;
+}
+
+/**
+ * @name    correct_shrinkage
+ * @brief   undoes the shrinkage of projected PC scores towards zero
+ *
+ * Projections of samples that were not in the reference are shrunk towards
+ * zero, because the reference loadings are fitted to the reference's noise as
+ * well as its structure. This follows the online augmentation, decomposition
+ * and Procrustes (OADP) method of Zhang, Dey and Lee (2020), one sample at a
+ * time. The reference U D V^T is augmented with the sample x as an extra row.
+ * Restricted to the span of V and the residual r = x - V V^T x, the augmented
+ * X^T X is the (K+1) x (K+1) matrix
+ *
+ *   [ D^2 + a a^T   |r| a ]
+ *   [ |r| a^T       |r|^2 ]
+ *
+ * where a = V^T x is the simple projection and |r|^2 = |x|^2 - |a|^2. With
+ * its top K eigenvectors Q the sample's augmented scores are Q^T (a,|r|) and
+ * the reference scores U D become U D Q. The scaled rotation that best maps D Q
+ * back to D, which needs neither U nor V, is applied to the sample's scores.
+ * Samples are shared between threads.
+ */
+void correct_shrinkage(const Eigen::VectorXf & sv,const Eigen::VectorXf & norm2,Eigen::MatrixXf & P)
+{
+    int N = P.rows(), K = P.cols();
+    assert(sv.size()==K && norm2.size()==N);
+    Eigen::VectorXd d = sv.cast<double>();
+#pragma omp parallel for schedule(static)
+    for(int i=0; i<N; i++)
+    {
+	Eigen::VectorXd ar(K+1);
+	ar.head(K) = P.row(i).transpose().cast<double>();
+	ar(K) = sqrt(max(0.0,norm2(i) - ar.head(K).squaredNorm()));
+	Eigen::MatrixXd C = ar * ar.transpose();
+	C.diagonal().head(K) += d.cwiseAbs2();
+	Eigen::SelfAdjointEigenSolver<Eigen::MatrixXd> eig(C);
+	Eigen::MatrixXd Q = eig.eigenvectors().rightCols(K); ///eigenvalues are ascending, the order does not matter to the Procrustes fit
+	Eigen::MatrixXd B = d.asDiagonal() * Q.topRows(K); ///augmented reference scores in the basis of U
+	Eigen::JacobiSVD<Eigen::MatrixXd> svd(B.transpose() * d.asDiagonal(),Eigen::ComputeFullU | Eigen::ComputeFullV);
+	Eigen::MatrixXd R = svd.matrixU() * svd.matrixV().transpose();
+	double c = svd.singularValues().sum() / B.squaredNorm();
+	P.row(i) = (c * (Q.transpose() * ar).transpose() * R).cast<float>();
+    }
+}
@@ -0,0 +1,82 @@
+#ifndef AKT_PCAMATRIX_H
+#define AKT_PCAMATRIX_H
+
+#include "akt.hh"
+#include "Eigen/Dense"
+#include "RandomSVD.hh"
+
+///samples accumulated together by PackedGenotypeMatrix::multiply (a multiple of 4)
+#define PCA_SAMPLE_TILE 512
+///markers accumulated together by PackedGenotypeMatrix::transposeMultiply
+#define PCA_MARKER_BLOCK 64
+
+//the N x M genotype matrix of akt pca --packed, held at 2 bits per dosage
+//(3 is missing) with the markers as columns.
+//
+//the randomised SVD only needs products with the standardised matrix, so the
+//centring (and the sqrt(2p(1-p)) scaling of covdef 1) is applied inside the
+//product kernels and the float matrix is never formed. memory is N x M / 4 bytes.
+class PackedGenotypeMatrix : public SVDOperator<Eigen::MatrixXf>
+{
+public:
+    PackedGenotypeMatrix(int nsample,int covn);
+    int rows() const {return _nsample;};
+    int cols() const {return _nmarker;};
+    void resize(int nmarker);
+    //packs marker m from nsample decode_gt codes and returns its mean dosage. missing
+    //genotypes are given the mean. may be called concurrently for different markers.
+    float setMarker(int m,const uint8_t *codes);
+    //out = A * R for the standardised N x M matrix A and an M x k matrix R
+    void multiply(const Eigen::MatrixXf & R,Eigen::MatrixXf & out) const;
+    //out = A^T * Y for an N x k matrix Y
+    void transposeMultiply(const Eigen::MatrixXf & Y,Eigen::MatrixXf & out) const;
+private:
+    typedef Eigen::Matrix<float,Eigen::Dynamic,Eigen::Dynamic,Eigen::RowMajor> RowMatrixXf;
+    void offsets(int m,float *d) const;
+    int _nsample,_nmarker,_covn;
+    size_t _stride; ///bytes per marker
+    vector<uint8_t> _packed;
+    vector<float> _mean,_scale;
+};
+
+///sites buffered by PcaProjection before they are multiplied in
+#define PCA_PROJECT_BLOCK 256
+
+//projection of samples onto precomputed loadings (akt pca -W). each site's
+//genotypes are buffered as decode_gt codes with its frequency and weights, and a
+//block of sites is standardised and multiplied into the N x k projection as one
+//product, split into tiles of samples across threads.
+class PcaProjection
+{
+public:
+    //missing genotypes are 0/0 with assume_homref, otherwise the expected dosage 2*af
+    PcaProjection(int nsample,int npc,bool assume_homref);
+    int npc() const {return _npc;};
+    //clears the projection for a new set of nsample samples, keeping the buffers
+    void reset(int nsample);
+    //adds a site with alternate allele frequency af and npc weights. codes holds
+    //nsample genotypes, or is NULL if the site is missing from the study.
+    void addSite(const uint8_t *codes,float af,const float *weights);
+    //multiplies in the buffered sites and returns the N x npc projection
+    const Eigen::MatrixXf & finish();
+    //the projection returned by the last finish()
+    const Eigen::MatrixXf & result() const {return _pc;};
+    //squared norm of each sample's standardised genotypes over the sites added
+    const Eigen::VectorXf & squaredNorms() const {return _norm2;};
+private:
+    void flush();
+    int _nsample,_npc,_nsite;
+    bool _assume_homref;
+    vector<uint8_t> _codes; ///_nsample codes per buffered site
+    float _value[PCA_PROJECT_BLOCK][4]; ///standardised dosage of codes 0/1/2 and missing
+    Eigen::MatrixXf _weights; ///PCA_PROJECT_BLOCK x npc
+    Eigen::MatrixXf _pc; ///N x npc
+    Eigen::VectorXf _norm2; ///N
+};
+
+//replaces the N x K simple projections P by scores corrected for their
+//shrinkage towards zero, given the K singular values sv of the reference
+//decomposition the weights came from and squaredNorms() of the projection.
+void correct_shrinkage(const Eigen::VectorXf & sv,const Eigen::VectorXf & norm2,Eigen::MatrixXf & P);
+
+#endif //AKT_PCAMATRIX_H
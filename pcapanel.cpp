@@ -0,0 +1,418 @@
+/**
+ * @file   pcapanel.cpp
+ * @brief  Compiled PCA weight panels for akt pca -W.
+ *
+ * Parsing a weights VCF through the synced reader takes seconds per run. The
+ * panel holds the same sites, frequencies and weights as flat arrays that are
+ * memory mapped, so a projection starts straight away and looks its sites up
+ * by binary search.
+ */
+
+#include "pcapanel.hh"
+#include "gtdecode.hh"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+static size_t pad64(size_t n)
+{
+    return (n+63)/64*64;
+}
+
+///header bytes before the names
+#define PCAPANEL_HEADER (8+4+4+8+8+8)
+
+struct PanelSite
+{
+    int contig,pos;
+    size_t idx; ///input order, for alleles and weights
+    bool operator<(const PanelSite & s) const {return contig<s.contig || (contig==s.contig && pos<s.pos);};
+};
+
+static void write_padded(FILE *fp,const void *p,size_t n,const string & filename)
+{
+    static const char zero[64] = {0};
+    if( (n>0 && fwrite(p,1,n,fp)!=n) || fwrite(zero,1,pad64(n)-n,fp)!=pad64(n)-n )
+    {
+	die("problem writing "+filename);
+    }
+}
+
+/**
+ * @name    build_pca_panel
+ * @brief   compile a weights vcf into a panel file
+ *
+ * Contigs are kept in the order they first appear and sites are sorted by
+ * position within each contig.
+ */
+void build_pca_panel(const string & vcf,const string & filename)
+{
+    htsFile *fp = hts_open(vcf.c_str(),"r");
+    if(fp==NULL)
+    {
+	die("problem opening "+vcf);
+    }
+    bcf_hdr_t *hdr = bcf_hdr_read(fp);
+    if(hdr==NULL)
+    {
+	die("problem reading the header of "+vcf);
+    }
+    bcf1_t *line = bcf_init1();
+    vector<string> contigs;
+    map<int,int> contig_of_rid;
+    vector<PanelSite> sites;
+    string alleles;
+    vector<size_t> allele_offset;
+    vector<float> af,weights;
+    float *af_ptr=NULL,*wts=NULL;
+    int naf=0,nwts=0,npc=-1,nskip=0;
+    while(bcf_read(fp,hdr,line)==0)
+    {
+	bcf_unpack(line,BCF_UN_STR);
+	int ret = bcf_get_info_float(hdr,line,"AF",&af_ptr,&naf);
+	if(ret<=0)
+	{
+	    die("no INFO/AF field in weights file");
+	}
+	int nw = bcf_get_info_float(hdr,line,"WEIGHT",&wts,&nwts);
+	if(nw<=0)
+	{
+	    cerr << bcf_hdr_id2name(hdr,line->rid)<<":"<<line->pos+1 << endl;
+	    die("no weights");
+	}
+	if(ret!=1 || line->n_allele!=2 || isnan(wts[0])) ///nan weights come from monomorphic sites in 1000g
+	{
+	    nskip++;
+	    continue;
+	}
+	if(npc<0)
+	{
+	    npc = nw;
+	}
+	if(nw!=npc)
+	{
+	    cerr << bcf_hdr_id2name(hdr,line->rid)<<":"<<line->pos+1 << endl;
+	    die("sites have different numbers of weights");
+	}
+	if(!contig_of_rid.count(line->rid))
+	{
+	    contig_of_rid[line->rid] = contigs.size();
+	    contigs.push_back(bcf_hdr_id2name(hdr,line->rid));
+	}
+	PanelSite site = {contig_of_rid[line->rid],line->pos,sites.size()};
+	sites.push_back(site);
+	allele_offset.push_back(alleles.size());
+	alleles.append(line->d.allele[0]);
+	alleles.push_back('\0');
+	alleles.append(line->d.allele[1]);
+	alleles.push_back('\0');
+	af.push_back(af_ptr[0]);
+	weights.insert(weights.end(),wts,wts+npc);
+    }
+    free(af_ptr);
+    free(wts);
+    bcf_destroy(line);
+    bcf_hdr_destroy(hdr);
+    hts_close(fp);
+    if(sites.empty())
+    {
+	die("no usable sites in "+vcf);
+    }
+    stable_sort(sites.begin(),sites.end());
+
+    size_t nsite = sites.size();
+    vector<uint64_t> index(contigs.size()+1,0),offset(nsite+1);
+    vector<int32_t> pos(nsite);
+    vector<float> sorted_af(nsite),sorted_weights(nsite*npc);
+    string sorted_alleles;
+    for(size_t s=0;s<nsite;s++)
+    {
+	size_t i = sites[s].idx;
+	index[sites[s].contig+1]++;
+	pos[s] = sites[s].pos;
+	offset[s] = sorted_alleles.size();
+	const char *a = &alleles[allele_offset[i]];
+	size_t len = strlen(a)+1;
+	len += strlen(a+len)+1;
+	sorted_alleles.append(a,len);
+	sorted_af[s] = af[i];
+	copy(&weights[i*npc],&weights[i*npc]+npc,&sorted_weights[s*npc]);
+    }
+    offset[nsite] = sorted_alleles.size();
+    for(size_t c=0;c<contigs.size();c++)
+    {
+	index[c+1] += index[c];
+    }
+
+    string names;
+    for(size_t c=0;c<contigs.size();c++)
+    {
+	names.append(contigs[c]);
+	names.push_back('\0');
+    }
+    FILE *out = fopen(filename.c_str(),"wb");
+    if(out==NULL)
+    {
+	die("could not open "+filename+" for writing");
+    }
+    uint32_t c32 = contigs.size(), k32 = npc;
+    uint64_t s64 = nsite, nb64 = names.size(), ab64 = sorted_alleles.size();
+    char header[PCAPANEL_HEADER];
+    memcpy(header,PCAPANEL_MAGIC,8);
+    memcpy(header+8,&c32,4);
+    memcpy(header+12,&k32,4);
+    memcpy(header+16,&s64,8);
+    memcpy(header+24,&nb64,8);
+    memcpy(header+32,&ab64,8);
+    string head(header,PCAPANEL_HEADER);
+    head += names;
+    write_padded(out,head.data(),head.size(),filename);
+    write_padded(out,&index[0],index.size()*sizeof(uint64_t),filename);
+    write_padded(out,&pos[0],nsite*sizeof(int32_t),filename);
+    write_padded(out,&offset[0],offset.size()*sizeof(uint64_t),filename);
+    write_padded(out,sorted_alleles.data(),sorted_alleles.size(),filename);
+    write_padded(out,&sorted_af[0],nsite*sizeof(float),filename);
+    write_padded(out,&sorted_weights[0],sorted_weights.size()*sizeof(float),filename);
+    if(fclose(out)!=0)
+    {
+	die("problem writing "+filename);
+    }
+    cerr << "Wrote " << nsite << " sites with " << npc << " PCs on " << contigs.size() << " contigs to " << filename;
+    cerr << " (skipped " << nskip << " multi-allelic, multi-AF or nan weight sites)" << endl;
+}
+
+bool PcaPanel::is_panel_file(const string & filename)
+{
+    char magic[8];
+    FILE *fp = fopen(filename.c_str(),"rb");
+    if(fp==NULL)
+    {
+	return false;
+    }
+    bool ret = fread(magic,1,8,fp)==8 && memcmp(magic,PCAPANEL_MAGIC,8)==0;
+    fclose(fp);
+    return ret;
+}
+
+PcaPanel::PcaPanel(const string & filename)
+{
+    int fd = open(filename.c_str(),O_RDONLY);
+    if(fd<0)
+    {
+	die("could not open "+filename);
+    }
+    struct stat st;
+    if(fstat(fd,&st)!=0 || st.st_size < PCAPANEL_HEADER)
+    {
+	die(filename+" is not an akt pca panel");
+    }
+    _size = st.st_size;
+    _data = (char *)mmap(NULL,_size,PROT_READ,MAP_SHARED,fd,0);
+    ::close(fd);
+    if(_data==MAP_FAILED)
+    {
+	die("could not memory map "+filename);
+    }
+    if(memcmp(_data,PCAPANEL_MAGIC,8)!=0)
+    {
+	die(filename+" is not an akt pca panel");
+    }
+    uint32_t c32,k32;
+    uint64_t s64,name_bytes,allele_bytes;
+    memcpy(&c32,_data+8,4);
+    memcpy(&k32,_data+12,4);
+    memcpy(&s64,_data+16,8);
+    memcpy(&name_bytes,_data+24,8);
+    memcpy(&allele_bytes,_data+32,8);
+    _ncontig = c32;
+    _npc = k32;
+    _nsite = s64;
+    size_t offset = pad64(PCAPANEL_HEADER+name_bytes);
+    size_t index_offset = offset;
+    offset += pad64((_ncontig+1)*sizeof(uint64_t));
+    size_t pos_offset = offset;
+    offset += pad64(_nsite*sizeof(int32_t));
+    size_t allele_offset = offset;
+    offset += pad64((_nsite+1)*sizeof(uint64_t));
+    size_t alleles = offset;
+    offset += pad64(allele_bytes);
+    size_t af_offset = offset;
+    offset += pad64(_nsite*sizeof(float));
+    size_t weight_offset = offset;
+    offset += pad64(_nsite*_npc*sizeof(float));
+    if(_size < offset)
+    {
+	die(filename+" is truncated or corrupt");
+    }
+    const char *p = _data+PCAPANEL_HEADER, *end = p+name_bytes;
+    while(p<end && (int)_contigs.size()<_ncontig)
+    {
+	_contig_index[p] = _contigs.size();
+	_contigs.push_back(string(p));
+	p += _contigs.back().size()+1;
+    }
+    if((int)_contigs.size()!=_ncontig)
+    {
+	die(filename+" is truncated or corrupt");
+    }
+    _index = (const uint64_t *)(_data+index_offset);
+    _pos = (const int32_t *)(_data+pos_offset);
+    _allele_offset = (const uint64_t *)(_data+allele_offset);
+    _alleles = _data+alleles;
+    _af = (const float *)(_data+af_offset);
+    _weights = (const float *)(_data+weight_offset);
+}
+
+PcaPanel::~PcaPanel()
+{
+    munmap(_data,_size);
+}
+
+int PcaPanel::contig_index(const string & name) const
+{
+    map<string,int>::const_iterator it = _contig_index.find(name);
+    return it==_contig_index.end() ? -1 : it->second;
+}
+
+long PcaPanel::find(int c,int pos,const char *ref,const char *alt) const
+{
+    const int32_t *first = _pos+begin(c), *last = _pos+end(c);
+    for(const int32_t *p = lower_bound(first,last,pos); p<last && *p==pos; p++)
+    {
+	size_t s = p-_pos;
+	if(strcmp(ref,this->ref(s))==0 && strcmp(alt,this->alt(s))==0)
+	{
+	    return s;
+	}
+    }
+    return -1;
+}
+
+string PcaPanel::regions(int gap) const
+{
+    string ret;
+    for(int c=0;c<_ncontig;c++)
+    {
+	size_t s = begin(c);
+	while(s<end(c))
+	{
+	    int from = _pos[s], to = _pos[s];
+	    for(s++; s<end(c) && _pos[s]-to < gap; s++)
+	    {
+		to = _pos[s];
+	    }
+	    if(!ret.empty())
+	    {
+		ret += ",";
+	    }
+	    ret += _contigs[c]+":"+to_string(from+1)+"-"+to_string(to+1);
+	}
+    }
+    return ret;
+}
+
+PanelProjector::PanelProjector(const PcaPanel & panel,int npc,bool assume_homref)
+    : _panel(panel), _assume_homref(assume_homref), _projection(0,npc,assume_homref)
+{
+    _regions = panel.regions(PANEL_REGION_GAP);
+    _found.resize(panel.nsite());
+    _nfound = 0;
+}
+
+/**
+ * @name    project
+ * @brief   projects the samples of one study onto the panel
+ *
+ * The study is read over regions covering the panel's sites and each record
+ * is looked up in the panel by contig, position and alleles. Problems with the
+ * study are returned rather than fatal so a long-lived caller can go on to
+ * the next one.
+ */
+bool PanelProjector::project(const string & filename,const sample_args & sargs,string & error)
+{
+    _nfound = 0;
+    _names.clear();
+    bcf_srs_t *sr =  bcf_sr_init() ; ///htslib synced reader.
+    sr->require_index = 1;
+    if ( bcf_sr_set_regions(sr, _regions.c_str(), 0)<0 )
+    {
+	bcf_sr_destroy(sr);
+	error = "failed to set the panel regions";
+	return false;
+    }
+    if(!(bcf_sr_add_reader (sr, filename.c_str() )))
+    {
+	bcf_sr_destroy(sr);
+	error = "problem opening " + filename;
+	return false;
+    }
+    bcf_hdr_t *hdr = sr->readers[0].header;
+    if(sargs.subsample)
+    {
+	bcf_hdr_set_samples(hdr, sargs.sample_names, sargs.sample_is_file);
+    }
+    int N = bcf_hdr_nsamples(hdr); ///number of samples;
+    if(N<=0)
+    {
+	bcf_sr_destroy(sr);
+	error = "no samples found in " + filename;
+	return false;
+    }
+    for(int i=0; i<N; ++i)
+    { 
+	_names.push_back(hdr->samples[i]);
+    }
+    _projection.reset(N);
+    _codes.resize(N);
+    fill(_found.begin(),_found.end(),false);
+
+    GtCounts counts;
+    int rid=-1,contig=-1;
+    while(bcf_sr_next_line (sr))
+    {
+	bcf1_t *line = bcf_sr_get_line(sr, 0);
+	if(line->rid != rid)
+	{
+	    rid = line->rid;
+	    contig = _panel.contig_index(bcf_hdr_id2name(hdr,rid));
+	}
+	if(contig<0 || line->n_allele!=2)
+	{
+	    continue;
+	}
+	bcf_unpack(line, BCF_UN_STR);
+	long site = _panel.find(contig,line->pos,line->d.allele[0],line->d.allele[1]);
+	if(site<0 || _found[site])
+	{
+	    continue;
+	}
+	if(decode_gt(hdr, line, &_codes[0], counts) < 0)
+	{
+	    stringstream ss;
+	    ss << "bad genotypes at " << bcf_hdr_id2name(hdr,line->rid) << ":" << line->pos+1;
+	    bcf_sr_destroy(sr);
+	    error = ss.str();
+	    return false;
+	}
+	_found[site] = true;
+	++_nfound;
+	_projection.addSite(&_codes[0],_panel.af(site),_panel.weights(site));
+    }
+    bcf_sr_destroy(sr);
+    if(_assume_homref)//other missing sites are 0 once centred and add nothing
+    {
+	for(size_t site=0; site<_panel.nsite(); site++)
+	{
+	    if(!_found[site])
+	    {
+		_projection.addSite(NULL,_panel.af(site),_panel.weights(site));
+	    }
+	}
+    }
+    _projection.finish();
+    return true;
+}
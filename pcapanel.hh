@@ -0,0 +1,103 @@
+#ifndef AKT_PCAPANEL_H
+#define AKT_PCAPANEL_H
+
+#include "akt.hh"
+#include "pcamatrix.hh"
+
+#include <string.h>
+
+//Compiled PCA weight panel for akt pca -W (written with --build-panel).
+//
+//layout (native byte order):
+//  char[8]  magic "AKTPCW01"
+//  uint32   number of contigs C
+//  uint32   number of PCs K
+//  uint64   number of sites S
+//  uint64   bytes of contig names (NUL terminated, in panel order)
+//  uint64   bytes of alleles
+//  names, zero padded to a multiple of 64 bytes
+//  then these arrays, each zero padded to a multiple of 64 bytes
+//  uint64   index: first site of each contig, C+1 of them
+//  int32    0-based position of each site, ascending within a contig
+//  uint64   offset of each site's alleles, S+1 of them
+//  char     alleles, "REF\0ALT\0" for each site
+//  float32  INFO/AF of each site
+//  float32  S x K INFO/WEIGHT, one row per site
+//
+//only bi-allelic sites with a single AF and non-nan weights are kept.
+
+#define PCAPANEL_MAGIC "AKTPCW01"
+
+//compiles the sites vcf with INFO/AF and INFO/WEIGHT into a panel file
+void build_pca_panel(const string & vcf,const string & filename);
+
+//read-only memory mapped view of a panel file
+class PcaPanel
+{
+public:
+    PcaPanel(const string & filename);
+    ~PcaPanel();
+    //true if filename starts with the panel magic
+    static bool is_panel_file(const string & filename);
+    int ncontig() const {return _ncontig;};
+    int npc() const {return _npc;};
+    size_t nsite() const {return _nsite;};
+    const string & contig(int c) const {return _contigs[c];};
+    //index of the contig called name, -1 if the panel has no sites on it
+    int contig_index(const string & name) const;
+    //sites of contig c are [begin(c),end(c))
+    size_t begin(int c) const {return _index[c];};
+    size_t end(int c) const {return _index[c+1];};
+    int pos(size_t s) const {return _pos[s];};
+    const char *ref(size_t s) const {return _alleles + _allele_offset[s];};
+    const char *alt(size_t s) const {return ref(s) + strlen(ref(s)) + 1;};
+    float af(size_t s) const {return _af[s];};
+    const float *weights(size_t s) const {return _weights + s*_npc;};
+    //site on contig c at pos (0-based) with these alleles, -1 if there is none
+    long find(int c,int pos,const char *ref,const char *alt) const;
+    //the sites as htslib regions ("chr:from-to,..."), sites closer than gap share a region
+    string regions(int gap) const;
+private:
+    PcaPanel(const PcaPanel &);
+    PcaPanel & operator=(const PcaPanel &);
+    int _ncontig,_npc;
+    size_t _nsite,_size;
+    vector<string> _contigs;
+    map<string,int> _contig_index;
+    char *_data;
+    const uint64_t *_index,*_allele_offset;
+    const int32_t *_pos;
+    const char *_alleles;
+    const float *_af,*_weights;
+};
+
+///panel sites closer than this are read from a study as one region
+#define PANEL_REGION_GAP 100000
+
+//projects studies onto a panel one after another. the panel's regions and the
+//projection buffers are kept between studies, so a long-lived process (akt pca
+//--batch) only pays for reading each study.
+class PanelProjector
+{
+public:
+    PanelProjector(const PcaPanel & panel,int npc,bool assume_homref);
+    //projects the samples of filename. on failure returns false and sets error
+    bool project(const string & filename,const sample_args & sargs,string & error);
+    const vector<string> & names() const {return _names;};
+    //number of panel sites found in the last study
+    size_t nfound() const {return _nfound;};
+    //N x npc projection of the last study
+    const Eigen::MatrixXf & projection() const {return _projection.result();};
+    const Eigen::VectorXf & squaredNorms() const {return _projection.squaredNorms();};
+private:
+    const PcaPanel & _panel;
+    string _regions;
+    bool _assume_homref;
+    PcaProjection _projection;
+    vector<bool> _found;
+    vector<uint8_t> _codes;
+    vector<string> _names;
+    size_t _nfound;
+};
+
+#endif //AKT_PCAPANEL_H
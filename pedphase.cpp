@@ -14,6 +14,7 @@ static void usage()
     fprintf(stderr, "    -O, --output-type <b|u|z|v>    b: compressed BCF, u: uncompressed BCF, z: compressed VCF, v: uncompressed VCF [v]\n");
     fprintf(stderr, "    -@, --threads                  number of compression/decompression threads to use\n");
     fprintf(stderr, "    -x, --exclude-chromosome       leave these chromosomes unphased (unphased lines will still be in in output)  eg. -x chrM,chrY\n");
+    fprintf(stderr, "        --stats-json <file>        write the time spent in each stage to this JSON file\n");
     exit(1);
 }
 
@@ -40,6 +41,7 @@ static void bcf_int32_set_missing(int32_t *array, int n)
 
 PedPhaser::PedPhaser(args &a)
 {
+    _stats.open("pedphase",a.stats_json);
     setup_io(a);
     cerr << "Reading input from " << a.inputfile << endl;    
     _num_sample = bcf_hdr_nsamples(_out_header);
@@ -76,6 +78,8 @@ PedPhaser::PedPhaser(args &a)
 
 void PedPhaser::main()
 {
+    double start = wall_time();
+    int num_site = 0;
     int min_distance_to_flush=10000;
     int prev_rid = -1;
     bcf1_t *line;
@@ -83,6 +87,7 @@ void PedPhaser::main()
     while (bcf_sr_next_line(_bcf_reader))
     {
         line = bcf_sr_get_line(_bcf_reader, 0);
+        num_site++;
 	if(line->rid!=prev_rid) flush_buffer();
 	prev_rid = line->rid;
 	
@@ -134,6 +139,10 @@ void PedPhaser::main()
 	}
     }
     flush_buffer();
+    _stats.addTime("ingest",wall_time()-start-_stats.time("phasing"));
+    _stats.set("samples",_num_sample);
+    _stats.set("sites",num_site);
+    _stats.write();
 }
 
 //performs simple duo/trio phasing using mendelian inheritance.
@@ -279,6 +288,7 @@ int PedPhaser::flush_buffer()
 {
 //    std::cerr<<"flushing buffer "<<_line_buffer.size()<<std::endl;//debug
     if (_line_buffer.empty()) return(0); 
+    StageTimer timer(_stats,"phasing");
     int _num_gt=0,_num_ps=0;
     HaplotypeBuffer hap_transmission(_num_sample,_pedigree);//stores the transmission phased haplotypes
     HaplotypeBuffer hap_phaseset(_num_sample,_pedigree);//stores the phase-set phased haplotypes
@@ -406,6 +416,7 @@ PedPhaser::~PedPhaser()
     if(_rps_array) free(_rps_array);
 }
 
+#define STATS_JSON 209
 int pedphase_main(int argc, char **argv)
 {
     int c;
@@ -423,6 +434,7 @@ int pedphase_main(int argc, char **argv)
         {"regions-file", required_argument, nullptr, 'R'},
         {"regions", required_argument, nullptr, 'r'},
         {"exclude-chromosome", required_argument, nullptr, 'x'},
+        {"stats-json", required_argument, nullptr, STATS_JSON},
         {0, 0, 0, 0}};
     arguments.regions_is_file = false;
     arguments.targets_is_file = false;
@@ -430,6 +442,7 @@ int pedphase_main(int argc, char **argv)
     arguments.outfile = "-";
     arguments.nthreads = 0;
     arguments.exclude_chromosomes = "";
+    arguments.stats_json = "";
 
     while ((c = getopt_long(argc, argv, "o:p:t:T:r:R:O:@:x:", loptions, nullptr)) >= 0)
     {
@@ -466,6 +479,9 @@ int pedphase_main(int argc, char **argv)
             arguments.regions = optarg;
             arguments.regions_is_file = true;
             break;
+        case STATS_JSON:
+            arguments.stats_json = optarg;
+            break;
         default:
             die("unknown argument");
         }
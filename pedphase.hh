@@ -16,6 +16,7 @@
 #include "version.hh"
 #include "HaplotypeBuffer.hh"
 #include "Genotype.hh"
+#include "stats.hh"
 
 typedef struct _args
 {
@@ -23,7 +24,7 @@ typedef struct _args
     bool regions_is_file;
     bool targets_is_file;
     char output_type;
-    string exclude_chromosomes;
+    string exclude_chromosomes,stats_json;
     const char *pedigree, *inputfile, *include, *regions, *targets, *outfile;
 } args;
 
@@ -60,6 +61,7 @@ private:
     vector<int> _chromosomes_to_ignore;//dont phase these chromosomes
     vector<bool> _sample_has_been_phased;
     vector< pair<int,int> >  _parental_genotypes;
+    RunStats _stats;
     void main();
 };
 
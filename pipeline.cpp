@@ -0,0 +1,139 @@
+/**
+ * @file   pipeline.cpp
+ * @brief  Background reader for the synced BCF reader.
+ */
+
+#include "pipeline.hh"
+
+extern "C" {
+#include "htslib/kstring.h"
+}
+
+using namespace std;
+
+BcfPipeline::BcfPipeline(bcf_srs_t *sr)
+{
+    _sr = sr;
+    _nreader = min(sr->nreaders,2);
+    _done = false;
+    _stop = false;
+    _thread = std::thread(&BcfPipeline::run,this);
+}
+
+BcfPipeline::~BcfPipeline()
+{
+    {
+	std::lock_guard<std::mutex> lock(_mutex);
+	_stop = true;
+    }
+    _drained.notify_all();
+    _thread.join();
+    for(size_t b=0; b<_queue.size(); b++)
+    {
+	for(size_t s=0; s<_queue[b].size(); s++)
+	{
+	    for(int r=0; r<2; r++)
+	    {
+		if(_queue[b][s].line[r]!=NULL)
+		{
+		    bcf_destroy(_queue[b][s].line[r]);
+		}
+	    }
+	}
+    }
+    for(size_t i=0; i<_free.size(); i++)
+    {
+	bcf_destroy(_free[i]);
+    }
+}
+
+///copies src into a recycled record. bcf_copy() is avoided as it does not reuse (or free) the buffers.
+bcf1_t *BcfPipeline::copy(bcf1_t *src)
+{
+    bcf1_t *dst = NULL;
+    {
+	std::lock_guard<std::mutex> lock(_mutex);
+	if(!_free.empty())
+	{
+	    dst = _free.back();
+	    _free.pop_back();
+	}
+    }
+    if(dst==NULL)
+    {
+	dst = bcf_init();
+    }
+    bcf_clear(dst);
+    dst->rid  = src->rid;
+    dst->pos  = src->pos;
+    dst->rlen = src->rlen;
+    dst->qual = src->qual;
+    dst->n_info = src->n_info;
+    dst->n_allele = src->n_allele;
+    dst->n_fmt = src->n_fmt;
+    dst->n_sample = src->n_sample;
+    dst->shared.l = 0;
+    kputsn(src->shared.s,src->shared.l,&dst->shared);
+    dst->indiv.l = 0;
+    kputsn(src->indiv.s,src->indiv.l,&dst->indiv);
+    return dst;
+}
+
+void BcfPipeline::run()
+{
+    vector<BcfSite> batch;
+    bool more = true;
+    while(more)
+    {
+	more = bcf_sr_next_line(_sr)>0;
+	if(more)
+	{
+	    BcfSite site;
+	    for(int r=0; r<2; r++)
+	    {
+		site.line[r] = r<_nreader && bcf_sr_has_line(_sr,r) ? copy(bcf_sr_get_line(_sr,r)) : NULL;
+	    }
+	    batch.push_back(site);
+	}
+	if(batch.size()==PIPELINE_BATCH || (!more && !batch.empty()))
+	{
+	    std::unique_lock<std::mutex> lock(_mutex);
+	    _drained.wait(lock,[this]{return _stop || _queue.size()<PIPELINE_DEPTH;});
+	    if(_stop)
+	    {
+		more = false;
+	    }
+	    _queue.push_back(vector<BcfSite>());
+	    _queue.back().swap(batch);
+	    _filled.notify_one();
+	}
+    }
+    std::lock_guard<std::mutex> lock(_mutex);
+    _done = true;
+    _filled.notify_one();
+}
+
+bool BcfPipeline::next(vector<BcfSite> & batch)
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    for(size_t s=0; s<batch.size(); s++)
+    {
+	for(int r=0; r<2; r++)
+	{
+	    if(batch[s].line[r]!=NULL)
+	    {
+		_free.push_back(batch[s].line[r]);
+	    }
+	}
+    }
+    batch.clear();
+    _filled.wait(lock,[this]{return _done || !_queue.empty();});
+    if(_queue.empty())
+    {
+	return false;
+    }
+    batch.swap(_queue.front());
+    _queue.pop_front();
+    _drained.notify_one();
+    return true;
+}
@@ -0,0 +1,50 @@
+#ifndef AKT_PIPELINE_H
+#define AKT_PIPELINE_H
+
+#include "akt.hh"
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+
+///sites handed from the reader thread to the workers at a time
+#define PIPELINE_BATCH 256
+///batches the reader thread may run ahead of the workers
+#define PIPELINE_DEPTH 4
+
+///one position of the synced reader, a private copy of each reader's line or NULL if absent
+struct BcfSite
+{
+    bcf1_t *line[2];
+};
+
+//reads a synced reader in a background thread.
+//
+//bcf_sr_next_line() (decompression and parsing, itself threaded through
+//bcf_sr_set_threads) runs ahead of the caller, which receives batches of
+//copied records and is free to decode them in parallel.
+class BcfPipeline
+{
+public:
+    BcfPipeline(bcf_srs_t *sr);
+    ~BcfPipeline();
+    //replaces batch with the next sites in file order, false at the end of the input.
+    //records in the previous batch are recycled so must not be kept.
+    bool next(vector<BcfSite> & batch);
+private:
+    BcfPipeline(const BcfPipeline &);
+    BcfPipeline & operator=(const BcfPipeline &);
+    void run();
+    bcf1_t *copy(bcf1_t *src);
+    bcf_srs_t *_sr;
+    int _nreader;
+    deque< vector<BcfSite> > _queue;
+    vector<bcf1_t *> _free;
+    bool _done,_stop;
+    std::mutex _mutex;
+    std::condition_variable _filled,_drained;
+    std::thread _thread;
+};
+
+#endif //AKT_PIPELINE_H
@@ -0,0 +1,220 @@
+/**
+ * @file   popcount.cpp
+ * @brief  Popcount kernels for the pairwise kinship loop.
+ *
+ * A portable kernel plus AVX2 (nibble lookup) and AVX-512 VPOPCNTDQ kernels.
+ * The vector kernels are compiled with target attributes so a single binary
+ * carries all of them, the best one is picked at runtime.
+ */
+
+#include "popcount.hh"
+#include "utils.hh"
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define AKT_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+template<int MODE>
+static void count_scalar(const uint64_t *a,const uint64_t *b,int nblock,PairCounts &counts)
+{
+    uint32_t n0=0,n1=0,n2=0,n3=0,nab=0,nba=0;
+    const uint64_t *end = a + (size_t)nblock*BLOCK_STRIDE;
+    for(; a<end; a+=BLOCK_STRIDE,b+=BLOCK_STRIDE)
+    {
+	for(int w=0; w<BLOCK_WORDS; ++w)
+	{
+	    const uint64_t *pa = a + w, *pb = b + w;
+	    n0 += __builtin_popcountll( (pa[0] & pb[2*BLOCK_WORDS]) | (pa[2*BLOCK_WORDS] & pb[0]) );
+	    n2 += __builtin_popcountll( (pa[0] & pb[0]) | (pa[BLOCK_WORDS] & pb[BLOCK_WORDS]) | (pa[2*BLOCK_WORDS] & pb[2*BLOCK_WORDS]) );
+	    n3 += __builtin_popcountll( pa[3*BLOCK_WORDS] | pb[3*BLOCK_WORDS] );
+	    if(MODE>=COUNT_HETHET)
+	    {
+		n1 += __builtin_popcountll( pa[BLOCK_WORDS] & pb[BLOCK_WORDS] );
+	    }
+	    if(MODE==COUNT_HETMISS)
+	    {
+		nab += __builtin_popcountll( pa[BLOCK_WORDS] & pb[3*BLOCK_WORDS] );
+		nba += __builtin_popcountll( pb[BLOCK_WORDS] & pa[3*BLOCK_WORDS] );
+	    }
+	}
+    }
+    counts.ibs0 += n0;
+    counts.ibs2 += n2;
+    counts.miss += n3;
+    counts.hethet += n1;
+    counts.hetmiss_a += nab;
+    counts.hetmiss_b += nba;
+}
+
+#ifdef AKT_X86_KERNELS
+
+//one plane of a block is exactly one 256-bit vector
+#if BLOCK_WORDS != 4
+#error "vector popcount kernels assume 256-marker blocks"
+#endif
+
+__attribute__((target("avx2")))
+static inline __m256i popcount_bytes(__m256i v)
+{
+    const __m256i lookup = _mm256_setr_epi8(0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4,
+					    0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4);
+    const __m256i low = _mm256_set1_epi8(0x0f);
+    __m256i lo = _mm256_shuffle_epi8(lookup, _mm256_and_si256(v, low));
+    __m256i hi = _mm256_shuffle_epi8(lookup, _mm256_and_si256(_mm256_srli_epi16(v, 4), low));
+    return _mm256_add_epi8(lo, hi);
+}
+
+__attribute__((target("avx2")))
+static inline uint64_t sum_epi64(__m256i v)
+{
+    return (uint64_t)_mm256_extract_epi64(v,0) + (uint64_t)_mm256_extract_epi64(v,1)
+	+ (uint64_t)_mm256_extract_epi64(v,2) + (uint64_t)_mm256_extract_epi64(v,3);
+}
+
+//byte counters take at most 8 per block, so they are widened every 31 blocks
+template<int MODE>
+__attribute__((target("avx2")))
+static void count_avx2(const uint64_t *a,const uint64_t *b,int nblock,PairCounts &counts)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i acc0 = zero, acc1 = zero, acc2 = zero, acc3 = zero, accab = zero, accba = zero;
+    int i = 0;
+    while(i<nblock)
+    {
+	int end = i+31 < nblock ? i+31 : nblock;
+	__m256i s0 = zero, s1 = zero, s2 = zero, s3 = zero, sab = zero, sba = zero;
+	for(; i<end; ++i)
+	{
+	    const __m256i *pa = (const __m256i *)(a + (size_t)i*BLOCK_STRIDE);
+	    const __m256i *pb = (const __m256i *)(b + (size_t)i*BLOCK_STRIDE);
+	    __m256i a0 = _mm256_loadu_si256(pa), a1 = _mm256_loadu_si256(pa+1);
+	    __m256i a2 = _mm256_loadu_si256(pa+2), a3 = _mm256_loadu_si256(pa+3);
+	    __m256i b0 = _mm256_loadu_si256(pb), b1 = _mm256_loadu_si256(pb+1);
+	    __m256i b2 = _mm256_loadu_si256(pb+2), b3 = _mm256_loadu_si256(pb+3);
+	    __m256i x0 = _mm256_or_si256(_mm256_and_si256(a0,b2), _mm256_and_si256(a2,b0));
+	    __m256i x2 = _mm256_or_si256(_mm256_or_si256(_mm256_and_si256(a0,b0), _mm256_and_si256(a1,b1)), _mm256_and_si256(a2,b2));
+	    __m256i x3 = _mm256_or_si256(a3,b3);
+	    s0 = _mm256_add_epi8(s0, popcount_bytes(x0));
+	    s2 = _mm256_add_epi8(s2, popcount_bytes(x2));
+	    s3 = _mm256_add_epi8(s3, popcount_bytes(x3));
+	    if(MODE>=COUNT_HETHET)
+	    {
+		s1 = _mm256_add_epi8(s1, popcount_bytes(_mm256_and_si256(a1,b1)));
+	    }
+	    if(MODE==COUNT_HETMISS)
+	    {
+		sab = _mm256_add_epi8(sab, popcount_bytes(_mm256_and_si256(a1,b3)));
+		sba = _mm256_add_epi8(sba, popcount_bytes(_mm256_and_si256(b1,a3)));
+	    }
+	}
+	acc0 = _mm256_add_epi64(acc0, _mm256_sad_epu8(s0, zero));
+	acc1 = _mm256_add_epi64(acc1, _mm256_sad_epu8(s1, zero));
+	accab = _mm256_add_epi64(accab, _mm256_sad_epu8(sab, zero));
+	accba = _mm256_add_epi64(accba, _mm256_sad_epu8(sba, zero));
+	acc2 = _mm256_add_epi64(acc2, _mm256_sad_epu8(s2, zero));
+	acc3 = _mm256_add_epi64(acc3, _mm256_sad_epu8(s3, zero));
+    }
+    counts.ibs0 += sum_epi64(acc0);
+    counts.ibs2 += sum_epi64(acc2);
+    counts.miss += sum_epi64(acc3);
+    counts.hethet += sum_epi64(acc1);
+    counts.hetmiss_a += sum_epi64(accab);
+    counts.hetmiss_b += sum_epi64(accba);
+}
+
+template<int MODE>
+__attribute__((target("avx2,avx512f,avx512vl,avx512vpopcntdq")))
+static void count_avx512(const uint64_t *a,const uint64_t *b,int nblock,PairCounts &counts)
+{
+    __m256i acc0 = _mm256_setzero_si256(), acc1 = acc0, acc2 = acc0, acc3 = acc0, accab = acc0, accba = acc0;
+    for(int i=0; i<nblock; ++i)
+    {
+	const __m256i *pa = (const __m256i *)(a + (size_t)i*BLOCK_STRIDE);
+	const __m256i *pb = (const __m256i *)(b + (size_t)i*BLOCK_STRIDE);
+	__m256i a0 = _mm256_loadu_si256(pa), a1 = _mm256_loadu_si256(pa+1);
+	__m256i a2 = _mm256_loadu_si256(pa+2), a3 = _mm256_loadu_si256(pa+3);
+	__m256i b0 = _mm256_loadu_si256(pb), b1 = _mm256_loadu_si256(pb+1);
+	__m256i b2 = _mm256_loadu_si256(pb+2), b3 = _mm256_loadu_si256(pb+3);
+	__m256i x0 = _mm256_or_si256(_mm256_and_si256(a0,b2), _mm256_and_si256(a2,b0));
+	__m256i x2 = _mm256_ternarylogic_epi64(_mm256_and_si256(a0,b0), a1, b1, 0xf8); // (a0&b0) | (a1&b1)
+	x2 = _mm256_or_si256(x2, _mm256_and_si256(a2,b2));
+	acc0 = _mm256_add_epi64(acc0, _mm256_popcnt_epi64(x0));
+	acc2 = _mm256_add_epi64(acc2, _mm256_popcnt_epi64(x2));
+	acc3 = _mm256_add_epi64(acc3, _mm256_popcnt_epi64(_mm256_or_si256(a3,b3)));
+	if(MODE>=COUNT_HETHET)
+	{
+	    acc1 = _mm256_add_epi64(acc1, _mm256_popcnt_epi64(_mm256_and_si256(a1,b1)));
+	}
+	if(MODE==COUNT_HETMISS)
+	{
+	    accab = _mm256_add_epi64(accab, _mm256_popcnt_epi64(_mm256_and_si256(a1,b3)));
+	    accba = _mm256_add_epi64(accba, _mm256_popcnt_epi64(_mm256_and_si256(b1,a3)));
+	}
+    }
+    counts.ibs0 += sum_epi64(acc0);
+    counts.ibs2 += sum_epi64(acc2);
+    counts.miss += sum_epi64(acc3);
+    counts.hethet += sum_epi64(acc1);
+    counts.hetmiss_a += sum_epi64(accab);
+    counts.hetmiss_b += sum_epi64(accba);
+}
+
+#endif //AKT_X86_KERNELS
+
+static const char *counter_name = "scalar";
+
+template<int MODE>
+static pair_counter choose_pair_counter()
+{
+    const char *force = getenv("AKT_POPCOUNT");
+#ifdef AKT_X86_KERNELS
+    __builtin_cpu_init();
+    bool has_avx2 = __builtin_cpu_supports("avx2");
+    bool has_avx512 = has_avx2 && __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vl") && __builtin_cpu_supports("avx512vpopcntdq");
+    if(force != NULL)
+    {
+	if(strcmp(force,"avx512")==0 && !has_avx512)
+	{
+	    die("AKT_POPCOUNT=avx512 but this CPU does not support AVX512-VPOPCNTDQ");
+	}
+	if(strcmp(force,"avx2")==0 && !has_avx2)
+	{
+	    die("AKT_POPCOUNT=avx2 but this CPU does not support AVX2");
+	}
+	has_avx512 = has_avx512 && strcmp(force,"avx512")==0;
+	has_avx2 = has_avx2 && (has_avx512 || strcmp(force,"avx2")==0);
+    }
+    if(has_avx512)
+    {
+	counter_name = "avx512";
+	return count_avx512<MODE>;
+    }
+    if(has_avx2)
+    {
+	counter_name = "avx2";
+	return count_avx2<MODE>;
+    }
+#endif
+    if(force != NULL && strcmp(force,"scalar")!=0)
+    {
+	die("unsupported AKT_POPCOUNT="+std::string(force));
+    }
+    counter_name = "scalar";
+    return count_scalar<MODE>;
+}
+
+pair_counter select_pair_counter(PairCountMode mode)
+{
+    static pair_counter counters[3] = {choose_pair_counter<COUNT_IBS>(),choose_pair_counter<COUNT_HETHET>(),choose_pair_counter<COUNT_HETMISS>()};
+    return counters[mode];
+}
+
+const char *pair_counter_name()
+{
+    select_pair_counter();
+    return counter_name;
+}
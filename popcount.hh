@@ -0,0 +1,48 @@
+#ifndef AKT_POPCOUNT_H
+#define AKT_POPCOUNT_H
+
+#include <stdint.h>
+
+///Size of bitset (markers per block).
+#define  BITSET_SIZE 256
+///64-bit words in one genotype plane of a block
+#define  BLOCK_WORDS (BITSET_SIZE/64)
+///genotype planes stored per block g=0 g=1 g=2 g=missing
+#define  NPLANE 4
+///words used by one sample for one block
+#define  BLOCK_STRIDE (NPLANE*BLOCK_WORDS)
+
+///popcount totals for a pair of samples, accumulated over blocks
+struct PairCounts
+{
+    PairCounts() : ibs0(0),ibs2(0),miss(0),hethet(0),hetmiss_a(0),hetmiss_b(0) {};
+    uint32_t ibs0; ///opposite homozygotes
+    uint32_t ibs2; ///identical genotypes
+    uint32_t miss; ///missing in either sample
+    uint32_t hethet; ///heterozygous in both samples (KING), only counted on request
+    uint32_t hetmiss_a; ///heterozygous in a and missing in b, only counted on request
+    uint32_t hetmiss_b; ///heterozygous in b and missing in a
+};
+
+///what a pair_counter counts beyond ibs0/ibs2/miss
+enum PairCountMode
+{
+    COUNT_IBS=0,     ///ibs0, ibs2 and miss only
+    COUNT_HETHET=1,  ///also hethet
+    COUNT_HETMISS=2  ///also hethet and hetmiss_a/hetmiss_b
+};
+
+//adds the counts for nblock consecutive blocks of two genotype rows to counts.
+//a sample has exactly one of the four planes set for each marker, so the
+//planes making up ibs0 and ibs2 are disjoint and are OR'd before counting.
+typedef void (*pair_counter)(const uint64_t *a,const uint64_t *b,int nblock,PairCounts &counts);
+
+//returns the fastest kernel this CPU supports (checked once via CPUID)
+//for the given counting mode.
+//AKT_POPCOUNT=scalar|avx2|avx512 in the environment overrides the choice.
+pair_counter select_pair_counter(PairCountMode mode=COUNT_IBS);
+
+//name of the kernel returned by select_pair_counter()
+const char *pair_counter_name();
+
+#endif //AKT_POPCOUNT_H
@@ -5,6 +5,7 @@
 #include "family.hh"
 #include "cluster.hh"
 #include "relatives.hh"
+#include "stats.hh"
 
 using namespace std;
 using namespace Eigen;
@@ -24,6 +25,7 @@ static void usage() {
     cerr << "\t -i --its:			number of iterations to find unrelated (10)" << endl;
     cerr << "\t -g --graphout:		if present output pedigree graph files" << endl;
     cerr << "\t -p --prefix:			output file prefix (out)" << endl;
+    cerr << "\t    --stats-json:		write the time spent in each stage to this JSON file" << endl;
     cerr << "arrow types     : solid black	= parent-child" << endl;
     cerr << "                : dotted black	= siblings" << endl;
     cerr << "                : blue 		= second order" << endl;
@@ -40,6 +42,7 @@ struct less_than_graph {
 };
 
 
+#define STATS_JSON 209
 int relatives_main(int argc, char *argv[]) {
 
     int c;
@@ -50,12 +53,14 @@ int relatives_main(int argc, char *argv[]) {
             {"its",      1, 0, 'i'},
             {"prefix",   1, 0, 'p'},
             {"graphout", 1, 0, 'g'},
+            {"stats-json", 1, 0, STATS_JSON},
             {0,          0, 0, 0}
     };
     float relmin = 0.05;
     int uits = 10;
     string prefix = "out.";
     bool gout = false;
+    string stats_json = "";
 
     while ((c = getopt_long(argc, argv, "k:i:p:g", loptions, NULL)) >= 0) {
         switch (c) {
@@ -72,6 +77,9 @@ int relatives_main(int argc, char *argv[]) {
                 prefix = (optarg);
                 prefix += ".";
                 break;
+            case STATS_JSON:
+                stats_json = optarg;
+                break;
             case '?':
                 usage();
             default:
@@ -82,19 +90,37 @@ int relatives_main(int argc, char *argv[]) {
     optind++;
     string cfilename = argv[optind];
     cerr << "Input: " << cfilename << endl;
+    RunStats stats;
+    stats.open("relatives", stats_json);
 
     //read ibd data
+    StageTimer read(stats, "read");
     vector<vector<string> > pnames;    //sample pairs
     set<string> unames;                    //sample names
     vector<vector<float> > ibd;        //ibd data
-    ifstream in(cfilename.c_str());
-    read_ibd1(in, ibd, pnames, unames, relmin);
-    in.close();
+    KinshipFile *binary_in = NULL;
+    KinshipGraph *graph_in = NULL;
+    if (KinshipGraph::is_graph_file(cfilename)) {
+        graph_in = new KinshipGraph(cfilename);
+        read_ibd1(*graph_in, ibd, pnames, unames, relmin);
+    } else if (KinshipFile::is_kinship_file(cfilename)) {
+        binary_in = new KinshipFile(cfilename);
+        read_ibd1(*binary_in, ibd, pnames, unames, relmin);
+    } else {
+        ifstream in(cfilename.c_str());
+        read_ibd1(in, ibd, pnames, unames, relmin);
+        in.close();
+    }
+
+    read.stop();
+    StageTimer cluster(stats, "cluster");
 
     int K = 6;
     int d = 2;
     int N = ibd.size();
     cerr << N << " ibd pairs above threshold" << endl;
+    stats.set("samples", unames.size());
+    stats.set("pairs", N);
 
     MatrixXf mu(K, d);    //cluster centres, known from theory
     mu(0, 0) = 0;
@@ -197,20 +223,34 @@ int relatives_main(int argc, char *argv[]) {
         }
     }
 
+    cluster.stop();
+    stats.set("families", DF.size());
+
     cerr << "Attempting to resolve pedigrees." << endl;
+    StageTimer read_families(stats, "read_families");
     //try to read every ibd pair
     vector<vector<float> > tibd;
     vector<vector<string> > pnamesr;
-    ifstream in2(cfilename.c_str());
-    int Nsamples = read_ibd2(in2, tibd, pnamesr);
-    in2.close();
-    //have to have all to all data
-    cerr << Nsamples << " unique samples names" << endl;
-    if (Nsamples * (Nsamples - 1) / 2 != (int) tibd.size()) {
-        cerr << "Found " << tibd.size() << " total pairs when " << Nsamples * (Nsamples - 1) / 2 << " expected."
-             << endl;
-        cerr << "\"akt relatives\" expects unfiltered output from \"akt kin\"." << endl;
-        exit(1);
+    if (graph_in != NULL) {
+        //the graph file stores every pair within its families
+        read_family_ibd(*graph_in, fam_names, tibd, pnamesr);
+        delete graph_in;
+    } else if (binary_in != NULL) {
+        //the binary file is all to all by construction, so only read pairs within families
+        read_family_ibd(*binary_in, fam_names, tibd, pnamesr);
+        delete binary_in;
+    } else {
+        ifstream in2(cfilename.c_str());
+        int Nsamples = read_ibd2(in2, tibd, pnamesr);
+        in2.close();
+        //have to have all to all data
+        cerr << Nsamples << " unique samples names" << endl;
+        if (Nsamples * (Nsamples - 1) / 2 != (int) tibd.size()) {
+            cerr << "Found " << tibd.size() << " total pairs when " << Nsamples * (Nsamples - 1) / 2 << " expected."
+                 << endl;
+            cerr << "\"akt relatives\" expects unfiltered output from \"akt kin\"." << endl;
+            exit(1);
+        }
     }
 
     vector<vector<vector<string> > > all_names(fam_labs.size());
@@ -234,6 +274,9 @@ int relatives_main(int argc, char *argv[]) {
 
     N = sz;
     cerr << N << " ibd pairs to cluster" << endl;
+    stats.set("family_pairs", N);
+    read_families.stop();
+    StageTimer pedigree(stats, "pedigree");
 
     //vector to Eigen
     MatrixXf Pr(N + K, d);
@@ -452,7 +495,8 @@ int relatives_main(int argc, char *argv[]) {
         H.ped_print(out_file2, fam_labs[n]);
     }
     out_file2.close();
-
+    pedigree.stop();
+    stats.write();
 
     return 0;
 }
@@ -523,3 +567,123 @@ int read_ibd2(ifstream &in, vector< vector<float> >  &ibd, vector< vector<string
     return (int)unames.size();
 }
 
+void read_ibd1(const KinshipFile &in, vector< vector<float> > &ibd, vector< vector<string> > &ln, set<string> &ls, float relmin )
+{
+    int N = in.nsample();
+    ls.insert(in.names().begin(), in.names().end());
+    size_t idx = 0;
+    for(int i=0; i<N; i++)
+    {
+        for(int j=i+1; j<N; j++,idx++)
+        {
+            float ks = in.value(KIN_KINSHIP, idx);
+            if( ks > relmin )
+            {
+                vector<string> tmps(2);
+                tmps[0] = in.name(i);
+                tmps[1] = in.name(j);
+                vector<float> tmp(3);
+                tmp[0] = in.value(KIN_IBD0, idx);
+                tmp[1] = in.value(KIN_IBD1, idx);
+                tmp[2] = ks;
+                ibd.push_back( tmp );
+                ln.push_back(tmps);
+            }
+        }
+    }
+}
+
+void read_family_ibd(const KinshipFile &in, map<string, string> &fam_names, vector< vector<float> > &ibd, vector< vector<string> > &ln )
+{
+    map<string, vector<int> > members; //sample indices of each family, ascending
+    for(int i=0; i<in.nsample(); i++)
+    {
+        map<string, string>::iterator it = fam_names.find(in.name(i));
+        if( it != fam_names.end() )
+        {
+            members[it->second].push_back(i);
+        }
+    }
+    for(map<string, vector<int> >::iterator it = members.begin(); it != members.end(); ++it)
+    {
+        vector<int> & m = it->second;
+        for(size_t a=0; a<m.size(); a++)
+        {
+            for(size_t b=a+1; b<m.size(); b++)
+            {
+                vector<string> tmps(2);
+                tmps[0] = in.name(m[a]);
+                tmps[1] = in.name(m[b]);
+                vector<float> tmp(2);
+                tmp[0] = in.get(KIN_IBD0, m[a], m[b]);
+                tmp[1] = in.get(KIN_IBD1, m[a], m[b]);
+                ibd.push_back( tmp );
+                ln.push_back(tmps);
+            }
+        }
+    }
+}
+
+void read_ibd1(const KinshipGraph &in, vector< vector<float> > &ibd, vector< vector<string> > &ln, set<string> &ls, float relmin )
+{
+    if( relmin < in.threshold() )
+    {
+        die("-k " + to_string(relmin) + " is below the threshold of the kin graph file (" + to_string(in.threshold()) + ")");
+    }
+    int N = in.nsample();
+    ls.insert(in.names().begin(), in.names().end());
+    for(int i=0; i<N; i++)
+    {
+        for(size_t e=in.row_begin(i); e<in.row_end(i); e++)
+        {
+            float ks = in.edge(KIN_KINSHIP, e);
+            if( ks > relmin )
+            {
+                vector<string> tmps(2);
+                tmps[0] = in.name(i);
+                tmps[1] = in.name(in.column(e));
+                vector<float> tmp(3);
+                tmp[0] = in.edge(KIN_IBD0, e);
+                tmp[1] = in.edge(KIN_IBD1, e);
+                tmp[2] = ks;
+                ibd.push_back( tmp );
+                ln.push_back(tmps);
+            }
+        }
+    }
+}
+
+void read_family_ibd(const KinshipGraph &in, map<string, string> &fam_names, vector< vector<float> > &ibd, vector< vector<string> > &ln )
+{
+    map<string, vector<int> > members; //sample indices of each family, ascending
+    for(int i=0; i<in.nsample(); i++)
+    {
+        map<string, string>::iterator it = fam_names.find(in.name(i));
+        if( it != fam_names.end() )
+        {
+            members[it->second].push_back(i);
+        }
+    }
+    for(map<string, vector<int> >::iterator it = members.begin(); it != members.end(); ++it)
+    {
+        vector<int> & m = it->second;
+        for(size_t a=0; a<m.size(); a++)
+        {
+            for(size_t b=a+1; b<m.size(); b++)
+            {
+                if( in.family_of(m[a]) < 0 || in.family_of(m[a]) != in.family_of(m[b]) )
+                {
+                    die(in.name(m[a]) + " and " + in.name(m[b]) + " are in different families of the kin graph file");
+                }
+                vector<string> tmps(2);
+                tmps[0] = in.name(m[a]);
+                tmps[1] = in.name(m[b]);
+                vector<float> tmp(2);
+                tmp[0] = in.get(KIN_IBD0, m[a], m[b]);
+                tmp[1] = in.get(KIN_IBD1, m[a], m[b]);
+                ibd.push_back( tmp );
+                ln.push_back(tmps);
+            }
+        }
+    }
+}
@@ -1,3 +1,5 @@
+#include "kinfile.hh"
+
 #include "akt.hh" 
 #include "family.hh"
 #include "cluster.hh"
@@ -27,4 +29,42 @@ void read_ibd1(ifstream &in, vector< vector<float> > &ibd, vector< vector<string
  * @param [in] ln	data container	- sample pairs
  * @return number of unique sample ids
  */
-int read_ibd2(ifstream &in, vector< vector<float> >  &ibd, vector< vector<string> > &ln );
\ No newline at end of file
+int read_ibd2(ifstream &in, vector< vector<float> >  &ibd, vector< vector<string> > &ln );
+
+
+/**
+ * @name    read_ibd1
+ * @brief   read all ibd values < cutoff from a binary akt kin file
+ */
+void read_ibd1(const KinshipFile &in, vector< vector<float> > &ibd, vector< vector<string> > &ln, set<string> &ls, float relmin );
+
+
+/**
+ * @name    read_family_ibd
+ * @brief   read ibd values for every pair of samples in the same family from a binary akt kin file
+ *
+ * pairs come out in the same order as the text output of akt kin
+ *
+ * @param [in] in  	binary akt kin file
+ * @param [in] fam_names	family label of each sample
+ * @param [in] ibd	data container	- ibd values
+ * @param [in] ln	data container	- sample pairs
+ */
+void read_family_ibd(const KinshipFile &in, map<string, string> &fam_names, vector< vector<float> > &ibd, vector< vector<string> > &ln );
+
+
+/**
+ * @name    read_ibd1
+ * @brief   read the edges with kinship > cutoff from an akt kin graph file
+ */
+void read_ibd1(const KinshipGraph &in, vector< vector<float> > &ibd, vector< vector<string> > &ln, set<string> &ls, float relmin );
+
+
+/**
+ * @name    read_family_ibd
+ * @brief   read ibd values for every pair of samples in the same family from an akt kin graph file
+ *
+ * families found by relatives lie within the graph's families as long as -k is not
+ * below the graph's threshold. pairs come out in the same order as the binary version.
+ */
+void read_family_ibd(const KinshipGraph &in, map<string, string> &fam_names, vector< vector<float> > &ibd, vector< vector<string> > &ln );
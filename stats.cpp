@@ -0,0 +1,166 @@
+/**
+ * @file   stats.cpp
+ * @brief  Stage timings and counters of a run as JSON.
+ */
+
+#include "stats.hh"
+#include "utils.hh"
+#include "version.hh"
+
+#include <chrono>
+#include <stdio.h>
+#include <sys/resource.h>
+
+using namespace std;
+
+double wall_time()
+{
+    return chrono::duration<double>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void add_value(vector< pair<string,double> > & values,const string & name,double value,bool accumulate)
+{
+    for(size_t i=0; i<values.size(); i++)
+    {
+	if(values[i].first==name)
+	{
+	    values[i].second = accumulate ? values[i].second+value : value;
+	    return;
+	}
+    }
+    values.push_back(make_pair(name,value));
+}
+
+static void write_values(FILE *fp,const char *name,const vector< pair<string,double> > & values)
+{
+    fprintf(fp,"  \"%s\": {",name);
+    for(size_t i=0; i<values.size(); i++)
+    {
+	fprintf(fp,"%s\n    \"%s\": %.9g",i ? "," : "",values[i].first.c_str(),values[i].second);
+    }
+    fprintf(fp,"%s}",values.empty() ? "" : "\n  ");
+}
+
+RunStats::RunStats()
+{
+    _start = wall_time();
+}
+
+///starts recording, the run's wall time is measured from here
+void RunStats::open(const string & command,const string & filename)
+{
+    _command = command;
+    _filename = filename;
+    _start = wall_time();
+}
+
+void RunStats::addTime(const string & stage,double seconds)
+{
+    if(enabled())
+    {
+	add_value(_stages,stage,seconds,true);
+    }
+}
+
+double RunStats::time(const string & stage) const
+{
+    for(size_t i=0; i<_stages.size(); i++)
+    {
+	if(_stages[i].first==stage)
+	{
+	    return _stages[i].second;
+	}
+    }
+    return 0;
+}
+
+void RunStats::addThreadTime(const string & stage,int thread,double seconds)
+{
+    if(!enabled())
+    {
+	return;
+    }
+    std::lock_guard<std::mutex> lock(_mutex);
+    size_t i = 0;
+    while(i<_thread_times.size() && _thread_times[i].first!=stage)
+    {
+	i++;
+    }
+    if(i==_thread_times.size())
+    {
+	_thread_times.push_back(make_pair(stage,vector<double>()));
+    }
+    vector<double> & times = _thread_times[i].second;
+    if((int)times.size()<=thread)
+    {
+	times.resize(thread+1,0);
+    }
+    times[thread] += seconds;
+}
+
+void RunStats::set(const string & counter,double value)
+{
+    if(enabled())
+    {
+	add_value(_counters,counter,value,false);
+    }
+}
+
+void RunStats::count(const string & counter,double value)
+{
+    if(enabled())
+    {
+	add_value(_counters,counter,value,true);
+    }
+}
+
+void RunStats::write() const
+{
+    if(!enabled())
+    {
+	return;
+    }
+    FILE *fp = fopen(_filename.c_str(),"w");
+    if(fp==NULL)
+    {
+	die("could not open "+_filename);
+    }
+    struct rusage usage;
+    getrusage(RUSAGE_SELF,&usage);
+    fprintf(fp,"{\n  \"command\": \"%s\",\n  \"version\": \"%s\",\n  \"wall_seconds\": %.9g,\n",_command.c_str(),AKT_VERSION,wall_time()-_start);
+    fprintf(fp,"  \"cpu_seconds\": %.9g,\n",usage.ru_utime.tv_sec+usage.ru_stime.tv_sec+1e-6*(usage.ru_utime.tv_usec+usage.ru_stime.tv_usec));
+    fprintf(fp,"  \"peak_rss_mb\": %.9g,\n",usage.ru_maxrss/1024.0);///ru_maxrss is in KB on Linux
+    write_values(fp,"stage_seconds",_stages);
+    fprintf(fp,",\n");
+    write_values(fp,"counters",_counters);
+    fprintf(fp,",\n  \"thread_busy_seconds\": {");
+    for(size_t i=0; i<_thread_times.size(); i++)
+    {
+	fprintf(fp,"%s\n    \"%s\": [",i ? "," : "",_thread_times[i].first.c_str());
+	for(size_t t=0; t<_thread_times[i].second.size(); t++)
+	{
+	    fprintf(fp,"%s%.9g",t ? ", " : "",_thread_times[i].second[t]);
+	}
+	fprintf(fp,"]");
+    }
+    fprintf(fp,"%s}\n}\n",_thread_times.empty() ? "" : "\n  ");
+    if(fclose(fp)!=0)
+    {
+	die("problem writing "+_filename);
+    }
+}
+
+StageTimer::StageTimer(RunStats & stats,const string & stage) : _stats(stats), _stage(stage)
+{
+    _start = wall_time();
+    _running = true;
+}
+
+void StageTimer::stop()
+{
+    if(_running)
+    {
+	_stats.addTime(_stage,wall_time()-_start);
+	_running = false;
+    }
+}
@@ -0,0 +1,53 @@
+#ifndef AKT_STATS_H
+#define AKT_STATS_H
+
+#include <string>
+#include <vector>
+#include <utility>
+#include <mutex>
+
+//seconds on a monotonic clock
+double wall_time();
+
+//wall time per stage, counters, per-thread busy time and peak RSS of one run,
+//written as JSON (--stats-json).
+//
+//stages and counters are kept in the order they are first recorded. everything
+//is a no-op until open() is given a file name, so callers need not check.
+class RunStats
+{
+public:
+    RunStats();
+    void open(const std::string & command,const std::string & filename);
+    bool enabled() const {return !_filename.empty();};
+    //adds seconds to a stage
+    void addTime(const std::string & stage,double seconds);
+    double time(const std::string & stage) const;
+    //adds the seconds a thread was busy in a (parallel) stage, may be called from any thread
+    void addThreadTime(const std::string & stage,int thread,double seconds);
+    void set(const std::string & counter,double value);
+    void count(const std::string & counter,double value=1);
+    void write() const;
+private:
+    std::string _command,_filename;
+    double _start;
+    std::vector< std::pair<std::string,double> > _stages,_counters;
+    std::vector< std::pair<std::string,std::vector<double> > > _thread_times;
+    std::mutex _mutex;
+};
+
+//adds the time until stop() (or destruction) to a stage
+class StageTimer
+{
+public:
+    StageTimer(RunStats & stats,const std::string & stage);
+    ~StageTimer() {stop();};
+    void stop();
+private:
+    RunStats & _stats;
+    std::string _stage;
+    double _start;
+    bool _running;
+};
+
+#endif //AKT_STATS_H
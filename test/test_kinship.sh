@@ -4,7 +4,7 @@ data=ALL.cgi_multi_sample.20130725.pruned.snps.bcf
 ##calculate kinship coefficients
 time ../akt kin -M 0 -@ 4 -R $reg $data > kinship0.txt
 time ../akt kin -M 1 -@ 4 -R $reg $data > kinship1.txt
-time ../akt kin -@ 4 -F $reg $data > kinship.txt
+time ../akt kin -@ 4 --ordered -F $reg $data > kinship.txt
 
 # check for unrelated
 ../akt unrelated kinship1.txt | sort > unrelated.out
@@ -13,3 +13,44 @@ time ../akt kin -@ 4 -F $reg $data > kinship.txt
 ##find relatives
 time ../akt relatives -p n433 kinship.txt > relatives.out
 python ped_compare.py  n433.fam  20130606_g1k.fam
+
+##binary output should give the same pedigrees
+time ../akt kin -@ 4 -F $reg -O b -o kinship.bin $data
+../akt relatives -p n433.bin kinship.bin > relatives.bin.out
+diff n433.fam n433.bin.fam
+diff relatives.out relatives.bin.out
+
+##so should the sparse graph, which reads pairs in the same order as the binary file
+../akt kin -@ 4 -F $reg -k 0.05 -O g -o kinship.graph $data
+../akt relatives -p n433.graph kinship.graph > relatives.graph.out
+diff n433.bin.fam n433.graph.fam
+diff relatives.bin.out relatives.graph.out
+
+##adding samples to a saved state should give the same pairs as a single run
+awk '{print $1;print $2}' kinship.txt | sort -u > samples.ids
+head -400 samples.ids > batch1.ids
+tail -n +401 samples.ids > batch2.ids
+../akt kin -F $reg -S batch1.ids --ordered --save-state kinship.kst -o kinship.inc.txt $data
+../akt kin --load-state kinship.kst -S batch2.ids -R $reg --ordered -o kinship.inc.txt $data
+sortpairs() { awk '{if($1>$2){t=$1;$1=$2;$2=t} print}' $1 | sort; }
+diff <(sortpairs kinship.txt) <(sortpairs kinship.inc.txt)
+
+##a pair list gives the same values as all pairs
+awk 'NR%100==0{print $1"\t"$2}' kinship.txt > pairs.txt
+../akt kin -F $reg -f pairs.txt $data > kinship.pairs.txt
+diff <(awk 'NR%100==0' kinship.txt) kinship.pairs.txt
+
+##normalising over each pair's called markers finds the same trios
+../akt kin -@ 4 -F $reg --pairwise-missing $data > kinship.pm.txt
+../akt relatives -p n433.pm kinship.pm.txt > /dev/null
+trios() { awk '{if($3>$4){t=$3;$3=$4;$4=t} print $2,$3,$4}' $1 | sort; }
+diff <(trios n433.fam) <(trios n433.pm.fam)
+
+##-M 2 writes the N(N+1)/2 float32 GRM triangle
+../akt kin -M 2 -R $reg -o kinship $data
+n=$(wc -l < kinship.grm.id)
+test $(stat -c %s kinship.grm.bin) -eq $((n*(n+1)*2))
+
+##--stats-json reports the stages of a run
+../akt unrelated --stats-json unrelated.json kinship.txt > /dev/null
+grep -q '"select"' unrelated.json
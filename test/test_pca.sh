@@ -1,8 +1,58 @@
 reg=../data/wgs.grch37.vcf.gz
 data=ALL.cgi_multi_sample.20130725.pruned.snps.bcf
+
+##|correlation| of each of the first n PCs of two outputs, fails if any is below min
+pccor() {
+    awk -v n=$3 -v min=$4 'NR==FNR{for(j=2;j<=n+1;j++) a[FNR,j]=$j; next}
+    {m=FNR; for(j=2;j<=n+1;j++){x=a[FNR,j]; y=$j; sx[j]+=x; sy[j]+=y; sxx[j]+=x*x; syy[j]+=y*y; sxy[j]+=x*y}}
+    END{for(j=2;j<=n+1;j++){c=(m*sxy[j]-sx[j]*sy[j])/sqrt((m*sxx[j]-sx[j]^2)*(m*syy[j]-sy[j]^2)); if(c<0) c=-c;
+        printf "PC%d |r|=%.5f\n",j-1,c; if(c<min) bad=1}; exit bad}' $1 $2
+}
+
+##largest difference in absolute value of each of the first n PCs of two outputs,
+##relative to the PC's largest value, fails if any is above tol
+pcabs() {
+    awk -v n=$3 -v tol=$4 'function abs(x){return x<0 ? -x : x}
+    NR==FNR{for(j=2;j<=n+1;j++) a[FNR,j]=abs($j); next}
+    {for(j=2;j<=n+1;j++){d=abs(a[FNR,j]-abs($j)); if(d>dmax[j]) dmax[j]=d; if(abs($j)>xmax[j]) xmax[j]=abs($j)}}
+    END{for(j=2;j<=n+1;j++){e=dmax[j]/xmax[j]; printf "PC%d %.2e\n",j-1,e; if(e>tol) bad=1}; exit bad}' $1 $2
+}
+
 ##pca of data
 time ../akt pca -R $reg $data  > pca1.txt
 
+##packed genotypes should give the same PCs
+time ../akt pca --packed -@ 4 -R $reg $data  > pca1.packed.txt
+cut -f1 pca1.txt | diff - <(cut -f1 pca1.packed.txt)
+pccor pca1.txt pca1.packed.txt 4 0.999
+pcabs pca1.txt pca1.packed.txt 4 1e-3
+
+##-C 2 should match PC1-PC4 of the unblocked matrix (pca1.symm.expected)
+time ../akt pca -C 2 -R $reg $data  > pca1.symm.txt
+cut -f1 pca1.symm.expected | diff - <(cut -f1 pca1.symm.txt)
+pccor pca1.symm.expected pca1.symm.txt 4 0.999
+pcabs pca1.symm.expected pca1.symm.txt 4 1e-3
+
 ##project data onto 1000G PCs
 time ../akt pca -W $reg $data  > pca2.txt
+
+##a compiled panel should give the same projections
+../akt pca -W $reg --build-panel wgs.pcapanel
+time ../akt pca -W wgs.pcapanel $data  > pca2.panel.txt
+cut -f1 pca2.txt | diff - <(cut -f1 pca2.panel.txt)
+pcabs pca2.txt pca2.panel.txt 20 1e-4
+echo $data | ../akt pca -W wgs.pcapanel --batch | cut -f2- | diff <(cut -f1-3 pca2.panel.txt) <(cut -f1-3 -)
+##held-out samples projected with the reference singular values (-F) should have
+##a spread closer to the reference samples' on the later PCs, where shrinkage is worst
+awk 'NR%3!=0{print $1}' pca1.txt > ref.ids
+awk 'NR%3==0{print $1}' pca1.txt > new.ids
+../akt pca -R $reg -S ref.ids -N 10 -o ref.pca.vcf -F ref.sv $data > ref.pcs.txt
+../akt pca -W ref.pca.vcf --build-panel ref.pcapanel
+../akt pca -W ref.pcapanel -S new.ids $data > new.simple.txt
+../akt pca -W ref.pcapanel -S new.ids -F ref.sv $data > new.oadp.txt
+awk -v n=6 'FNR==1{f++} {for(j=2;j<=n+1;j++){s[f,j]+=$j; ss[f,j]+=$j*$j}; m[f]=FNR}
+    END{for(j=2;j<=n+1;j++){for(f=1;f<=3;f++) sd[f]=sqrt(ss[f,j]/m[f]-(s[f,j]/m[f])^2);
+        simple=sd[2]/sd[1]; oadp=sd[3]/sd[1]; printf "PC%d spread relative to reference: %.3f simple %.3f corrected\n",j-1,simple,oadp;
+        if(j>=5 && (oadp-1)^2 >= (simple-1)^2) bad=1}; exit bad}' ref.pcs.txt new.simple.txt new.oadp.txt
+
 Rscript ../scripts/1000G_pca.R pca2.txt 
@@ -3,6 +3,7 @@
 #include "family.hh"
 #include "cluster.hh"
 #include "relatives.hh"
+#include "stats.hh"
 
 using namespace std;
 using namespace Eigen;
@@ -21,6 +22,7 @@ static void usage()
     cerr << "./akt unrelated ibdfile" << endl;
     cerr << "\t -k --kmin:			threshold for relatedness (0.025)" << endl;
     cerr << "\t -i --its:			number of iterations to find unrelated (10)" << endl;
+    cerr << "\t    --stats-json:		write the time spent in each stage to this JSON file" << endl;
     exit(1);
 }
 
@@ -34,6 +36,7 @@ struct less_than_graph
 };
 
 
+#define STATS_JSON 209
 int unrelated_main(int argc, char* argv[])
 {
 
@@ -43,17 +46,20 @@ int unrelated_main(int argc, char* argv[])
     static struct option loptions[] =    {
             {"kmin",1,0,'k'},
             {"its",1,0,'i'},
+            {"stats-json",1,0,STATS_JSON},
             {0,0,0,0}
     };
     float relmin = 0.025;
     int uits = 10;
     string prefix="out.";
+    string stats_json = "";
 
     while ((c = getopt_long(argc, argv, "k:i:?",loptions,NULL)) >= 0) {
         switch (c)
         {
             case 'k': relmin = atof(optarg); break;
             case 'i': uits = atoi(optarg); break;
+            case STATS_JSON: stats_json = optarg; break;
             case '?': usage();
             default: cerr << "Unknown argument:"+(string)optarg+"\n" << endl; exit(1);
         }
@@ -61,15 +67,36 @@ int unrelated_main(int argc, char* argv[])
     optind++;
     string cfilename = argv[optind];
     cerr <<"Input: " << cfilename << endl;
+    RunStats stats;
+    stats.open("unrelated",stats_json);
 
     //read ibd data
+    StageTimer read(stats,"read");
     vector< vector<string> > pnames;	//sample pairs
     set<string> unames;					//sample names
     vector< vector<float> > ibd;		//ibd data
-    ifstream in(cfilename.c_str());
-    read_ibd1(in, ibd, pnames, unames, relmin);
-    in.close();
+    if (KinshipGraph::is_graph_file(cfilename))
+    {
+        KinshipGraph in(cfilename);
+        read_ibd1(in, ibd, pnames, unames, relmin);
+    }
+    else if (KinshipFile::is_kinship_file(cfilename))
+    {
+        KinshipFile in(cfilename);
+        read_ibd1(in, ibd, pnames, unames, relmin);
+    }
+    else
+    {
+        ifstream in(cfilename.c_str());
+        read_ibd1(in, ibd, pnames, unames, relmin);
+        in.close();
+    }
+
+    read.stop();
+    stats.set("samples",unames.size());
+    stats.set("pairs",pnames.size());
 
+    StageTimer select(stats,"select");
     graph F;    //contains families only
     for (size_t i = 0; i < pnames.size(); i++)    //for all pairs
     {
@@ -138,6 +165,9 @@ int unrelated_main(int argc, char* argv[])
     }
 
     cerr << uc << " nominally unrelated samples." << endl;
+    select.stop();
+    stats.set("unrelated",uc);
+    stats.write();
 
     return 0;
 }
@@ -9,13 +9,26 @@
  * a site only vcf.
  */
  
-//because the one big multiplication it isn't worth the set up
+//the SVD products are split into blocks across threads by RandomSVD.hh and
+//pcamatrix.cpp, each block is a single threaded Eigen product
 #define EIGEN_DONT_PARALLELIZE
  
 #include "akt.hh"
 #include "Eigen/Dense"
 #include "RandomSVD.hh"
+#include "pcamatrix.hh"
+#include "pcapanel.hh"
 #include "reader.hh"
+#include "pipeline.hh"
+#include "gtdecode.hh"
+#include "stats.hh"
+
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
 
 using namespace Eigen;
 
@@ -46,31 +59,90 @@ static void usage()
 //    umessage('h');
 //    umessage('m');
     cerr << "\nPCA options:"<<endl;
-    cerr << "\t -W --weight:			VCF with weights for PCA" << endl;
+    cerr << "\t -W --weight:			VCF with weights for PCA, or a panel compiled from one with --build-panel" << endl;
+    cerr << "\t    --build-panel:		compile the -W VCF into this binary panel file and exit" << endl;
+    cerr << "\t    --batch:			project each file named on stdin onto the -W panel, one result block per file" << endl;
+    cerr << "\t    --socket:			as --batch but read file names from clients of this local socket" << endl;
     cerr << "\t -N --npca:			first N principle components" << endl;
     cerr << "\t -a --alg:			exact SVD (slow)" << endl;
     cerr << "\t -C --covdef:			definition of SVD matrix: 0=(G-mu) 1=(G-mu)/sqrt(p(1-p)) 2=diag-G(2-G) default(1)" << endl;
     cerr << "\t -e --extra:			extra vectors for Red SVD" << endl;
     cerr << "\t -q --iterations                number of power iterations (default 10 is sufficient)" << endl;
-    cerr << "\t -F --svfile:			File containing singular values" << endl;
+    cerr << "\t -F --svfile:			File containing singular values (written, or read with -W to correct projections for shrinkage)" << endl;
+    cerr << "\t    --packed:			hold genotypes at 2 bits each and stream them through the SVD (less memory, -C 0/1 only)" << endl;
     cerr << "\t -H --assume-homref:            Assume missing genotypes/sites are homozygous reference (useful for projecting a single sample)" << endl;    
+    cerr << "\t    --stats-json:		write the time spent in each stage to this JSON file" << endl;
+    umessage('@');
     exit(1);
 }
         
         
+///print projections to stdout
+static void print_projection(const vector<string> & names,const MatrixXf & P)
+{
+    for(size_t n=0; n<names.size(); ++n)
+    {
+	cout << names[n] << "\t";
+	for(int i=0;i<P.cols();i++)
+	{ 
+	    cout << P(n,i) << "\t";
+	}
+	cout << "\n";
+    }
+}
+
+///singular values written by -F, one per line
+static VectorXf read_singular_values(const string & filename)
+{
+    ifstream in(filename.c_str());
+    if(!in)
+    {
+	die("could not open "+filename);
+    }
+    vector<float> sv;
+    float x;
+    while(in >> x)
+    {
+	sv.push_back(x);
+    }
+    if(sv.empty())
+    {
+	die("no singular values in "+filename);
+    }
+    return Map<VectorXf>(&sv[0],sv.size());
+}
+
+///the first npca PCs of a projection, corrected for shrinkage if the reference singular values sv were given
+static MatrixXf adjusted_projection(const MatrixXf & P,const VectorXf & norm2,const VectorXf & sv,int npca)
+{
+    MatrixXf Q = P;
+    if(sv.size()>0)
+    {
+	correct_shrinkage(sv.head(P.cols()),norm2,Q);
+    }
+    return Q.leftCols(npca);
+}
+
 /**
  * @name    pca
  * @brief   Use weights in vcf2 to project vcf1
  *
+ * INFO/AF and INFO/WEIGHT are decoded once per site and the genotypes with
+ * GT decoded straight from the record, the projection is then accumulated a
+ * block of sites at a time by PcaProjection.
+ *
  * @param [in] vcf1  vcf file to project
  * @param [in] vcf2  site only vcf containing PCA weights
+ * @param [in] sv  singular values of the reference (-F), empty for no shrinkage correction
  *
  */
-void pca(string vcf1,string vcf2, bool don, int maxn, sample_args sargs,bool assume_homref)
+void pca(string vcf1,string vcf2, bool don, int maxn, sample_args sargs,bool assume_homref,const VectorXf & sv,RunStats & stats)
 {
+    StageTimer projection(stats,"projection");
 	
     int Nsamples;
     int Npca=0;  
+    int nweight=0;///PCs projected
 
     vector<string> names;
 	
@@ -105,7 +177,6 @@ void pca(string vcf1,string vcf2, bool don, int maxn, sample_args sargs,bool ass
 		
     int ret;
     bcf1_t *line0, *line1;
-    int *gt_arr=NULL;int ngt=0,ngt_arr=0;
     float *wts=NULL;int nwts=0;
 
     int N = bcf_hdr_nsamples(sr->readers[0].header); ///number of samples;
@@ -122,10 +193,10 @@ void pca(string vcf1,string vcf2, bool don, int maxn, sample_args sargs,bool ass
 	names.push_back(tmp);
     }	
     
-    int nPC=0; ///number of pcs;
-    vector< vector<float> > PC(N);///principal components.
+    PcaProjection *PC = NULL;///principal components, created once the number of PCs is known
 
-    vector<float> gs(N);///genotypes, defaults to 0/0 - these should be easily called sites.	
+    vector<uint8_t> codes(N);///genotypes, sites missing from vcf1 are all missing
+    GtCounts counts;
     float *af_ptr=NULL,af;///read AF
     int nval = 0;
 		
@@ -152,110 +223,65 @@ void pca(string vcf1,string vcf2, bool don, int maxn, sample_args sargs,bool ass
 		die("no INFO/AF field in weights file");
 	    }
 	    af = af_ptr[0];
+		
+	    if(ret!=1)
+	    {
+		cerr << "WARNING: no AF field at "<<line1->pos+1<<endl;
+		continue;
+	    }
 
-	    ngt=2*N;
-	    if(bcf_sr_has_line(sr,0))
+	    //read PCA loadings
+	    ret =  bcf_get_info_float(sr->readers[1].header , line1, "WEIGHT", &wts, &nwts);
+	    if(ret<=0)
 	    {
-		line0 =  bcf_sr_get_line(sr, 0);
-		ngt = bcf_get_genotypes(sr->readers[0].header, line0, &gt_arr, &ngt_arr);	//get genotypes
+		cerr << bcf_hdr_id2name(sr->readers[1].header,line1->rid)<<":"<<line1->pos+1 << endl;
+		cerr << "no weights" << endl; 
+		exit(1);
+	    }
+	    if(isnan(wts[0])) ///sometimes you get nan weights due to monormoprhic sites in 1000g
+	    {
+		continue;
 	    }
 
-	    if(ngt==2*N)	///only diploid sites
+	    if(PC==NULL) 	//set correct number of Principle components
 	    {
-		for(int i=0; i<2*N; i+=2)	///all samples in vcf
+		if( don && maxn > 0 )
 		{
-		    if(bcf_sr_has_line(sr,0) && gt_arr[i]!=bcf_gt_missing && gt_arr[i+1]!=bcf_gt_missing)
-		    {
-			gs[i/2] = (float)(bcf_gt_allele(gt_arr[i]) + bcf_gt_allele(gt_arr[i+1]));
-		    }
-		    else
-		    {
-			if(assume_homref)
-			{
-			    gs[i/2] = 0.0;    ///assume missing sites are homozygous reference (works okay for single sample calling when sites are reliable)
-			}
-			else
-			{
-			    gs[i/2] = 2*af;	///assign missing sites to expected af			    
-			}
-		    }
+		    Npca = min( maxn, ret );
 		}
+		else
+		{
+		    Npca = ret;
+		}
+		nweight = sv.size()>0 ? min(ret,(int)sv.size()) : Npca;//the correction uses every PC
+		Npca = min(Npca,nweight);
+		cerr << "Using " << Npca << " PCs from input file." << endl;
+		PC = new PcaProjection(N,nweight,assume_homref);
 	    }
-		
-	    if(ret!=1)
+	    if(ret < nweight)
 	    {
-		cerr << "WARNING: no AF field at "<<line1->pos+1<<endl;
+		cerr << bcf_hdr_id2name(sr->readers[1].header,line1->rid)<<":"<<line1->pos+1 << endl;
+		die("fewer weights than at the first site");
 	    }
-	    else
-	    {	
-		for(int n=0; n<N; ++n)
+
+	    const uint8_t *gt = NULL;
+	    if(bcf_sr_has_line(sr,0))
+	    {
+		line0 =  bcf_sr_get_line(sr, 0);
+		if(decode_gt(sr->readers[0].header, line0, &codes[0], counts) < 0)	//haploid samples are missing
 		{
-		    
-		    if(!(gs[n]>=0 && gs[n]<=2))
-		    {
-			cerr << "ERROR at " << bcf_hdr_id2name(sr->readers[0].header,line0->rid) <<":"<<line0->pos+1 <<" g = "<<gs[n]<<" af="<<af<<endl;
-			exit(1);
-		    }
-		    //read PCA loadings
-		    ret =  bcf_get_info_float(sr->readers[1].header , line1, "WEIGHT", &wts, &nwts);
-		    if(ret<=0)
-		    {
-			cerr << bcf_hdr_id2name(sr->readers[1].header,line1->rid)<<":"<<line1->pos+1 << endl;
-			cerr << "no weights" << endl; 
-			exit(1);
-		    }
-			
-				  
-		    if(!isnan(wts[0])) ///sometimes you get nan weights due to monormoprhic sites in 1000g
-		    {
-			gs[n] -= 2*af; //zero mean
-			gs[n] /= sqrt(2*af*(1-af));
-			if(nPC==0) 	//set correct number of Principle components
-			{
-			    if( don )
-			    {
-				if(maxn > 0)
-				{
-				    nPC = min( maxn, nwts );
-				}
-				else
-				{
-				    nPC = nwts;
-				}
-			    }
-			    else
-			    {
-				nPC = nwts;
-			    }
-			    if(nPC==0)
-			    {
-				cerr << "No principle components found in file" << endl; exit(1);
-			    }
-			    cerr << "Using " << nPC << " PCs from input file." << endl;
-			    Npca = nPC;
-			}
-			if(PC[n].size() != (unsigned)nPC)	//initialise vector
-			{
-			    PC[n].assign(nPC,0.);
-			}
-			for(int i=0;i<nPC;i++)	//projection
-			{
-			    PC[n][i] += wts[i]*gs[n];
-			}
-			if( isnan( PC[n][0] ) )
-			{
-			    cerr << "nan value found. something went wrong." << endl; 
-			    exit(1);
-			}
-		    }
+		    cerr << "Bad genotypes at " <<  bcf_hdr_id2name(sr->readers[0].header,line0->rid) << ":" << line0->pos+1 << endl;
+		    exit(1);
 		}
+		gt = &codes[0];
 	    }
+	    PC->addSite(gt,af,wts);
 	}
 		
     }
     bcf_sr_destroy(sr);
-    free(gt_arr);
     free(wts);
+    free(af_ptr);
 
     cerr << n0 << "/" << n1 << " of sites were in "<< vcf1 << endl;
     if(!assume_homref &&  (float)n0/n1 < 0.9)
@@ -266,21 +292,207 @@ void pca(string vcf1,string vcf2, bool don, int maxn, sample_args sargs,bool ass
     {
 	cerr << "No intersecting SNPs found.  Check chromosome prefix matches on sites and input file." << endl; exit(1);
     }
-    ///print projections to stdout
-    for(int n=0; n<Nsamples; ++n)
+    if(PC==NULL)
     {
-	cout << names[n] << "\t";
-	for(int i=0;i<Npca;i++)
-	{ 
-	    cout << PC[n][i] << "\t";
-	}
-	cout << "\n";
+	cerr << "No principle components found in file" << endl; exit(1);
+    }
+    MatrixXf P = adjusted_projection(PC->finish(),PC->squaredNorms(),sv,Npca);
+    if( !P.allFinite() )
+    {
+	cerr << "nan value found. something went wrong." << endl; 
+	exit(1);
+    }
+    projection.stop();
+    stats.set("samples",Nsamples);
+    stats.set("markers",n0);
+    StageTimer output(stats,"output");
+    print_projection(names,P);
+    delete PC;
+    output.stop();
+    stats.write();
+}
+
+/**
+ * @name    pca_panel
+ * @brief   Use the weights in a compiled panel to project vcf1
+ *
+ * Only the study is parsed. It is read over regions covering the panel's
+ * sites and each record is looked up in the memory mapped panel by contig,
+ * position and alleles.
+ *
+ * @param [in] vcf1  vcf file to project
+ * @param [in] panel_file  panel written by --build-panel
+ * @param [in] sv  singular values of the reference (-F), empty for no shrinkage correction
+ *
+ */
+void pca_panel(string vcf1,string panel_file, bool don, int maxn, sample_args sargs,bool assume_homref,const VectorXf & sv,RunStats & stats)
+{
+    StageTimer projection(stats,"projection");
+    PcaPanel panel(panel_file);
+    int nweight = sv.size()>0 ? min(panel.npc(),(int)sv.size()) : panel.npc();
+    int Npca = (don && maxn > 0) ? min(maxn,nweight) : nweight;
+    PanelProjector projector(panel,sv.size()>0 ? nweight : Npca,assume_homref);
+    string error;
+    if(!projector.project(vcf1,sargs,error))
+    {
+	die(error);
     }
+    const vector<string> & names = projector.names();
+    int N = names.size();
+    cerr << N << " samples" << endl;
+    cerr << "Using " << Npca << " PCs from input file." << endl;
 
+    int n0 = projector.nfound(), n1 = panel.nsite();
+    cerr << n0 << "/" << n1 << " of sites were in "<< vcf1 << endl;
+    if(!assume_homref &&  (float)n0/n1 < 0.9)
+    {
+	die("less that 90% of sites in "+panel_file+" were NOT in "+vcf1+"\nTry --assume-homref if you have a small number of samples");
+    }
+    if(n0==0)
+    {
+	cerr << "No intersecting SNPs found.  Check chromosome prefix matches on sites and input file." << endl; exit(1);
+    }
+    MatrixXf P = adjusted_projection(projector.projection(),projector.squaredNorms(),sv,Npca);
+    if( !P.allFinite() )
+    {
+	cerr << "nan value found. something went wrong." << endl; 
+	exit(1);
+    }
+    projection.stop();
+    stats.set("samples",N);
+    stats.set("markers",n0);
+    StageTimer output(stats,"output");
+    print_projection(names,P);
+    output.stop();
+    stats.write();
 }
 
+/**
+ * @name    serve_projections
+ * @brief   projects each study named on in and writes its rows to out
+ *
+ * Rows are "path<TAB>sample<TAB>PC1..." and a study that cannot be projected
+ * gives a single "path<TAB>ERROR<TAB>message" row. out is flushed after every
+ * study so a caller can wait on each result.
+ */
+static void serve_projections(PanelProjector & projector,FILE *in,FILE *out,const sample_args & sargs,
+			      size_t nsite,bool assume_homref,const VectorXf & sv,int npca,RunStats & stats)
+{
+    char *buf = NULL;
+    size_t len = 0;
+    while(getline(&buf,&len,in) != -1)
+    {
+	string path(buf);
+	path.erase(path.find_last_not_of(" \t\r\n")+1);
+	if(path.empty())
+	{
+	    continue;
+	}
+	double start = wall_time();
+	string error;
+	MatrixXf P;
+	if(projector.project(path,sargs,error))
+	{
+	    P = adjusted_projection(projector.projection(),projector.squaredNorms(),sv,npca);
+	    size_t n0 = projector.nfound();
+	    if(n0==0)
+	    {
+		error = "no intersecting SNPs found";
+	    }
+	    else if(!assume_homref && (float)n0/nsite < 0.9)
+	    {
+		error = "less than 90% of panel sites were in the study, try --assume-homref";
+	    }
+	    else if(!P.allFinite())
+	    {
+		error = "nan value found";
+	    }
+	}
+	if(error.empty())
+	{
+	    const vector<string> & names = projector.names();
+	    for(size_t n=0; n<names.size(); ++n)
+	    {
+		fprintf(out,"%s\t%s",path.c_str(),names[n].c_str());
+		for(int i=0;i<P.cols();i++)
+		{ 
+		    fprintf(out,"\t%g",P(n,i));
+		}
+		fputc('\n',out);
+	    }
+	}
+	else
+	{
+	    fprintf(out,"%s\tERROR\t%s\n",path.c_str(),error.c_str());
+	}
+	fflush(out);
+	stats.addTime("projection",wall_time()-start);
+	stats.count(error.empty() ? "inputs" : "failed_inputs");
+    }
+    free(buf);
+}
 
+/**
+ * @name    pca_batch
+ * @brief   long-lived projection of many studies onto a compiled panel
+ *
+ * The panel is mapped and its regions built once, then study paths are read
+ * one per line from stdin, or from each client of a local socket when
+ * socket_path is given, and projected as they arrive.
+ */
+void pca_batch(string panel_file,string socket_path, bool don, int maxn, sample_args sargs,bool assume_homref,const VectorXf & sv,RunStats & stats)
+{
+    PcaPanel panel(panel_file);
+    int nweight = sv.size()>0 ? min(panel.npc(),(int)sv.size()) : panel.npc();
+    int Npca = (don && maxn > 0) ? min(maxn,nweight) : nweight;
+    PanelProjector projector(panel,sv.size()>0 ? nweight : Npca,assume_homref);
+    cerr << "Using " << Npca << " PCs from " << panel_file << endl;
+    if(socket_path.empty())
+    {
+	serve_projections(projector,stdin,stdout,sargs,panel.nsite(),assume_homref,sv,Npca,stats);
+	stats.write();
+	return;
+    }
 
+    struct sockaddr_un addr;
+    memset(&addr,0,sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if(socket_path.size() >= sizeof(addr.sun_path))
+    {
+	die("socket path is too long: "+socket_path);
+    }
+    strcpy(addr.sun_path,socket_path.c_str());
+    struct stat st;
+    if(lstat(socket_path.c_str(),&st)==0)//only a stale socket is removed
+    {
+	if(!S_ISSOCK(st.st_mode))
+	{
+	    die(socket_path+" exists and is not a socket");
+	}
+	unlink(socket_path.c_str());
+    }
+    int fd = socket(AF_UNIX,SOCK_STREAM,0);
+    if(fd<0 || bind(fd,(struct sockaddr *)&addr,sizeof(addr))<0 || listen(fd,16)<0)
+    {
+	die("could not listen on "+socket_path);
+    }
+    signal(SIGPIPE,SIG_IGN);//a client that goes away only ends its own connection
+    cerr << "Listening on " << socket_path << endl;
+    while(true)
+    {
+	int client = accept(fd,NULL,NULL);
+	if(client<0)
+	{
+	    continue;
+	}
+	FILE *in = fdopen(client,"r");
+	FILE *out = fdopen(dup(client),"w");
+	serve_projections(projector,in,out,sargs,panel.nsite(),assume_homref,sv,Npca,stats);
+	fclose(in);
+	fclose(out);
+	stats.write();
+    }
+}
 
 /**
  * @name    DatatoMatrix
@@ -315,14 +527,21 @@ void DatatoMatrix(Ref<MatrixXf> A, vector<float> &G, vector<float> AF, int N, in
 	}
     } 
 }
+///markers centred and multiplied in at a time by DatatoSymmMatrix
+#define PCA_SYMM_CHUNK 1024
+///samples per side of a tile of the DatatoSymmMatrix product, tiles are shared between threads
+#define PCA_SYMM_TILE 256
+
 /**
  * @name    DatatoSymmMatrix
  * @brief   Turn a std vector into an Eigen Matrix subtract bias correction
  * http://www.ncbi.nlm.nih.gov/pubmed/26482676
  *
- * Eigen matrices have no push operator, since number of markers is variable
- * we have to fill the matrix ourselves.
- * @param [in] A   Matrix to get written
+ * The N x N matrix is (Z Z^T - diag(sum G(2-G))) / norm for the centred genotypes
+ * Z. Z Z^T is built as a symmetric rank-k update per chunk of markers, split
+ * into tiles of its lower triangle across threads, and the diagonal bias and
+ * upper triangle are filled in at the end.
+ * @param [in] A   N x N matrix to get written
  * @param [in] G   vector containing vcf info
  * @param [in] AF  vector of allele frequencies * 2
  * @param [in] N   number of samples
@@ -331,7 +550,7 @@ void DatatoMatrix(Ref<MatrixXf> A, vector<float> &G, vector<float> AF, int N, in
  */
 void DatatoSymmMatrix(Ref<MatrixXf> A, vector<float> &G, vector<float> AF, int N, int M)
 {
-
+    assert(A.rows()==N && A.cols()==N);
     float norm = 0;
     for(int i=0; i<M; ++i)
     {
@@ -339,31 +558,44 @@ void DatatoSymmMatrix(Ref<MatrixXf> A, vector<float> &G, vector<float> AF, int N
     }
     norm /= 4;
 
-    for(int j1=0; j1<N; ++j1)
+    vector< pair<int,int> > tiles;
+    for(int ti=0; ti<N; ti+=PCA_SYMM_TILE)
+    {
+	for(int tj=0; tj<=ti; tj+=PCA_SYMM_TILE)
+	{
+	    tiles.push_back(make_pair(ti,tj));
+	}
+    }
+    A.setZero();
+    ArrayXf bias = ArrayXf::Zero(N); ///sum of G(2-G) for each sample
+    MatrixXf Z(N, min(M,PCA_SYMM_CHUNK));
+    for(int m0=0; m0<M; m0+=PCA_SYMM_CHUNK)
     {
-	for(int j2=j1; j2<N; ++j2)
+	int nm = min(PCA_SYMM_CHUNK,M-m0);
+	for(int i=0; i<nm; ++i)
 	{
-	    A(j1,j2) = 0;
-	    if( j1 == j2)
+	    Map<const ArrayXf> g(&G[(size_t)(m0+i)*N],N);
+	    Z.col(i) = g - AF[m0+i];
+	    bias += g * (2 - g);
+	}
+#pragma omp parallel for schedule(dynamic,1)
+	for(size_t t=0; t<tiles.size(); t++)
+	{
+	    int ti = tiles[t].first, tj = tiles[t].second;
+	    int ni = min(PCA_SYMM_TILE,N-ti), nj = min(PCA_SYMM_TILE,N-tj);
+	    if(ti != tj)
 	    {
-		for(int i=0; i<M; ++i)
-		{
-		    A(j1,j2) += (G[i*N + j1] - AF[i]) * (G[i*N + j1] - AF[i]) - G[i*N + j1]*(2 - G[i*N + j1]);
-		}
+		A.block(ti,tj,ni,nj).noalias() += Z.block(ti,0,ni,nm) * Z.block(tj,0,nj,nm).transpose();
 	    }
 	    else
 	    {
-		for(int i=0; i<M; ++i)
-		{
-		    A(j1,j2) += (G[i*N + j1] - AF[i]) * (G[i*N + j2] - AF[i]);
-		}
+		A.block(ti,ti,ni,ni).selfadjointView<Lower>().rankUpdate(Z.block(ti,0,ni,nm));
 	    }
-
-	    A(j1,j2) /= norm;
-	    A(j2,j1) = A(j1,j2);
-	
-	}}
-
+	}
+    }
+    A.diagonal().array() -= bias;
+    A.triangularView<StrictlyUpper>() = A.transpose();
+    A /= norm;
 }
 
 /**
@@ -380,11 +612,13 @@ void DatatoSymmMatrix(Ref<MatrixXf> A, vector<float> &G, vector<float> AF, int N
  * @param [in] extra   		number of extra vectors for RedSVD
  * @param [in] regions   	which variants to use
  * @param [in] pfile   		intersecting variant list
+ * @param [in] packed   	store genotypes at 2 bits per dosage instead of as floats
  *
  */
 void calcpca(string input_name, bool o, string outf, string output_name, float m, int k, bool a, int npca, int extra,
-	     string targets,string regions, bool regions_is_file,  sample_args sargs, int covn, string svfilename,int niteration) 
+	     string targets,string regions, bool regions_is_file,  sample_args sargs, int covn, string svfilename,int niteration,bool packed,RunStats & stats) 
 {
+    StageTimer ingest(stats,"ingest");
 	
     cerr << "Reading data..." << endl;
 	  
@@ -448,7 +682,6 @@ void calcpca(string input_name, bool o, string outf, string output_name, float m
 	cerr<<"ERROR: no samples found in "+input_name<<endl;
 	exit(1);
     }
-    int *gt_arr=(int *)malloc(N*2*sizeof(int)),ngt=N*2,ngt_arr=N*2;
 	
     cerr << N << " samples" << endl;
     for(int i=0; i<N; ++i)
@@ -458,86 +691,136 @@ void calcpca(string input_name, bool o, string outf, string output_name, float m
     }
     
 
-    vector<float> G; G.reserve(50000*N); ///genotypes stored here temporarily. 
+    vector<float> G; ///genotypes stored here temporarily. 
+    PackedGenotypeMatrix *P2 = NULL; ///or packed at 2 bits each with --packed
+    if(packed)
+    {
+	P2 = new PackedGenotypeMatrix(N,covn);
+    }
+    else
+    {
+	G.reserve(50000*N);
+    }
     vector<float> AF;
     vector<int> sites;
 	
     int count=0;
-    bcf1_t *line;///bcf/vcf line structure.
-	
-    while(bcf_sr_next_line (sr))
+
+//records are read by a background thread and each batch is decoded in parallel,
+//the thinning/frequency filter then runs in file order and the kept sites are
+//copied into G in parallel.
+    vector<BcfSite> batch;
+    vector<int> site_ok(PIPELINE_BATCH);
+    vector<GtCounts> site_counts(PIPELINE_BATCH);
+    vector<uint8_t> code_batch((size_t)PIPELINE_BATCH*N);
+    vector<int> kept;
+    int nhaploid = 0;
+    bool timing = stats.enabled();
+    BcfPipeline pipe(sr);
+    while(pipe.next(batch))
     { //read
-		
-	bool read = ( pfilename == "" ) ? true : (bcf_sr_has_line(sr,0) && bcf_sr_has_line(sr,1));
-	if( read )
-	{	//present in sites file and sample file.			
-	    line =  bcf_sr_get_line(sr, 0);
-	    ngt = bcf_get_genotypes(sr->readers[0].header, line, &gt_arr, &ngt_arr);    
-	    if(ngt < 0)
+	int nb = batch.size();
+#pragma omp parallel
+	{
+	    double start = timing ? wall_time() : 0;
+#pragma omp for schedule(dynamic,4)
+	    for(int r=0;r<nb;r++)
 	    {
-		cerr << "Bad genotypes at " <<  bcf_hdr_id2name(sr->readers[0].header,line->rid) << ":" << line->pos+1 << endl;
-		exit(1);
+		bcf1_t *line = batch[r].line[0];
+		bool read = ( pfilename == "" ) ? true : (line!=NULL && batch[r].line[1]!=NULL);
+		if( read )
+		{	//present in sites file and sample file.			
+		    site_ok[r] = decode_gt(sr->readers[0].header, line, &code_batch[(size_t)r*N], site_counts[r]);
+		}
+	    }
+	    if(timing)
+	    {
+		stats.addThreadTime("decode",omp_get_thread_num(),wall_time()-start);
 	    }
-			
-	    int mac = 0,nmiss=0;
-	    for(int i=0;i<2*N;i++)
-	    {	//calc allele count
-		if(gt_arr[i]!=bcf_gt_missing)
+	}
+
+	kept.clear();
+	for(int r=0;r<nb;r++)
+	{
+	    bcf1_t *line = batch[r].line[0];
+	    bool read = ( pfilename == "" ) ? true : (line!=NULL && batch[r].line[1]!=NULL);
+	    if( read )
+	    {
+		if(site_ok[r] < 0)
 		{
-		    mac += bcf_gt_allele(gt_arr[i]);
+		    cerr << "Bad genotypes at " <<  bcf_hdr_id2name(sr->readers[0].header,line->rid) << ":" << line->pos+1 << endl;
+		    exit(1);
 		}
-		else
+		if(site_counts[r].nhaploid > 0)	///sites with non-diploid samples are not used
 		{
-		    ++nmiss;
+		    nhaploid++;
 		}
-	    }
-	    float frq = (float)mac / (float)(2*N-nmiss);	///allele frequency
-
-	    //minor allele freq
-	    if(mac > (2*N-nmiss)/2) mac = (2*N-nmiss)-mac;
-	    if(mac > (2*N-nmiss)*m) ++count;
+		else
+		{
+		    int mac = site_counts[r].ac,nmiss = 2*N - site_counts[r].an;
 
-	    //keep every k of these sites
-	    if(count%k==0 && mac > (2*N-nmiss)*m )
-	    { //remember, 0%k == 0
-				
-		float mu = 0;	///actual mean =/= frq because default = 2*frq
-		sites.push_back(nline);
+		    //minor allele freq
+		    if(mac > (2*N-nmiss)/2) mac = (2*N-nmiss)-mac;
+		    if(mac > (2*N-nmiss)*m) ++count;
 
-		for(int i=0;i<N;i++)
-		{
-		    if( gt_arr[2*i] < 0 || gt_arr[2*i+1] < 0 )
-		    {
-			cerr << "Fix Ploidy on " << line->rid << ":" << line->pos+1 << " sample " 
-			     << sr->readers[0].header->samples[i] << endl; exit(1);
-		    }
-		    if(gt_arr[2*i]!=bcf_gt_missing && gt_arr[2*i+1]!=bcf_gt_missing)
-		    {
-			G.push_back((float)(bcf_gt_allele(gt_arr[2*i])+bcf_gt_allele(gt_arr[2*i+1])));
-		    }
-		    else
-		    {
-			G.push_back(2*frq);      ///if missing push the "expected genotype" based on allele frequency.
+		    //keep every k of these sites
+		    if(count%k==0 && mac > (2*N-nmiss)*m )
+		    { //remember, 0%k == 0
+			sites.push_back(nline);
+			kept.push_back(r);
 		    }
-		    mu += G.back();
 		}
-		AF.push_back(mu/(float)N );
-		++nkept;
 	    }
-	} //end sites file check
-	if( bcf_sr_has_line(sr,0) )
+	    if( line!=NULL )
+	    {
+		++nline;
+	    } //lines in sample file
+	    if( pfilename != "" && batch[r].line[1]!=NULL )
+	    {
+		++npanel;
+	    };
+	}
+
+	size_t g0 = G.size();
+	if(P2!=NULL)
+	{
+	    P2->resize(nkept + kept.size());
+	}
+	else
 	{
-	    ++nline;
-	} //lines in sample file
-	if( pfilename != "" && bcf_sr_has_line(sr,1) )
+	    G.resize(g0 + kept.size()*N);
+	}
+	AF.resize(nkept + kept.size());
+#pragma omp parallel for schedule(dynamic,4)
+	for(size_t c=0;c<kept.size();c++)
 	{
-	    ++npanel;
-	};
+	    int r = kept[c];
+	    const uint8_t *code = &code_batch[(size_t)r*N];
+	    if(P2!=NULL)
+	    {
+		AF[nkept+c] = P2->setMarker(nkept+c,code);
+		continue;
+	    }
+	    float frq = (float)site_counts[r].ac / (float)site_counts[r].an;	///allele frequency
+	    float mu = 0;	///actual mean =/= frq because default = 2*frq
+	    float *g = &G[g0 + c*N];
+	    for(int i=0;i<N;i++)
+	    {
+		///if missing use the "expected genotype" based on allele frequency.
+		g[i] = code[i]!=GT_MISSING ? (float)code[i] : 2*frq;
+		mu += g[i];
+	    }
+	    AF[nkept+c] = mu/(float)N;
+	}
+	nkept += kept.size();
     }  
 	
     bcf_sr_destroy(sr);	
-    free(gt_arr);	
 	
+    if( nhaploid > 0 )
+    {
+	cerr << "WARNING: skipped " << nhaploid << " sites with non-diploid genotypes" << endl;
+    }
     if( pfilename != "" )
     {
 	cerr << nkept << "/"<<npanel<<" of study markers were in the sites file"<<endl;
@@ -552,20 +835,33 @@ void calcpca(string input_name, bool o, string outf, string output_name, float m
 	cerr << "ERROR: no intersecting SNPs found.  Check chromosome prefix matches on sites and input file." << endl; exit(1);
     }
     int M = nkept;
+    ingest.stop();
+    stats.set("samples",N);
+    stats.set("sites_read",nline);
+    stats.set("markers",M);
 	
+    StageTimer matrix(stats,"matrix");
     int vsize = M;
     //vector to Eigen
-    MatrixXf A(N, vsize); ///rows = samples, cols = markers
-    if(covn >= 2)
+    MatrixXf A; ///rows = samples, cols = markers
+    if(P2==NULL)//packed genotypes are standardised as the SVD streams through them
     {
-	vsize = N;
-	DatatoSymmMatrix(A, G, AF, N, M);
-    }
-    else
-    {
-	DatatoMatrix(A, G, AF, N, M, covn);
+	if(covn >= 2)
+	{
+	    vsize = N;
+	    A.resize(N, N);
+	    DatatoSymmMatrix(A, G, AF, N, M);
+	}
+	else
+	{
+	    A.resize(N, vsize);
+	    DatatoMatrix(A, G, AF, N, M, covn);
+	}
     }
 	
+    matrix.stop();
+	
+    StageTimer decomposition(stats,"svd");
     MatrixXf P = MatrixXf::Zero(N,npca);
     MatrixXf V(vsize, npca);
     
@@ -594,7 +890,9 @@ void calcpca(string input_name, bool o, string outf, string output_name, float m
     else//approximate randomised svd
     {
 	int e = min(  min(N,vsize)-npca  , extra);
-	RandomSVD<MatrixXf> svd(A, npca + e,niteration);
+	DenseSVDOperator<MatrixXf> dense(A);
+	const SVDOperator<MatrixXf> & op = P2!=NULL ? (const SVDOperator<MatrixXf> &)*P2 : dense;
+	RandomSVD<MatrixXf> svd(op, npca + e,niteration);
 	for(int j=0; j<npca; ++j)
 	{ 
 	    P.col(j).noalias() = svd.matrixU().col(j) * svd.singularValues()(j) ;
@@ -605,12 +903,15 @@ void calcpca(string input_name, bool o, string outf, string output_name, float m
 	}
 	V.noalias() = svd.matrixV().block(0,0,vsize,npca);
     } 
+    delete P2;
 
     if(out_sv)
     {
 	out_file.close();
     }
+    decomposition.stop();
 	
+    StageTimer output(stats,"output");
     if(o) 	//output sites file
     {	
 	cerr <<"Printing coefficients to " << output_name << endl; 
@@ -707,13 +1008,19 @@ void calcpca(string input_name, bool o, string outf, string output_name, float m
     {
 	cout << names[j] << "\t" << P.row(j) << endl;
     }
-	
+    output.stop();
+    stats.write();
 
 }
 
 
 
 #define FORCE 100
+#define STATS_JSON 209
+#define PACKED 210
+#define BUILD_PANEL 211
+#define BATCH 212
+#define SOCKET 213
 int pca_main(int argc,char **argv)
 {
     
@@ -731,12 +1038,18 @@ int pca_main(int argc,char **argv)
         {"maf",1,0,'m'},
         {"npca",1,0,'N'},
         {"alg",0,0,'a'},
-        {"covdef",0,0,'C'},
+        {"covdef",1,0,'C'},
         {"extra",1,0,'e'},
         {"samples",1,0,'s'},
         {"samples-file",1,0,'S'},
 	{"force",0,0,FORCE},
 	{"assume-homref",0,0,'H'},		
+	{"stats-json",1,0,STATS_JSON},	
+	{"packed",0,0,PACKED},
+	{"threads",1,0,'@'},
+	{"build-panel",1,0,BUILD_PANEL},
+	{"batch",0,0,BATCH},
+	{"socket",1,0,SOCKET},
         {0,0,0,0}
     };
     bool force = false;
@@ -761,7 +1074,13 @@ int pca_main(int argc,char **argv)
     bool assume_homref=false;
     string svfilename = "";
     int niteration=10;
-    while ((c = getopt_long(argc, argv, "q:o:O:W:N:Hae:t:T:r:R:s:S:C:F:",loptions,NULL)) >= 0) 
+    string stats_json = "";
+    bool packed = false;
+    int nthreads = -1;
+    string panel_filename = "";
+    bool batch = false;
+    string socket_path = "";
+    while ((c = getopt_long(argc, argv, "q:o:O:W:N:Hae:t:T:r:R:s:S:C:F:@:",loptions,NULL)) >= 0) 
     {
 	switch (c)
 	{
@@ -780,6 +1099,12 @@ int pca_main(int argc,char **argv)
 	case 't': targets = (optarg);  break;    
 	case 'T': targets = (optarg);  regions_is_file=true; break;    
 	case 'F': svfilename = (optarg);  break;    
+	case STATS_JSON: stats_json = optarg; break;
+	case PACKED: packed = true; break;
+	case '@': nthreads = atoi(optarg); break;
+	case BUILD_PANEL: panel_filename = optarg; break;
+	case BATCH: batch = true; break;
+	case SOCKET: batch = true; socket_path = optarg; break;
 
         case 's': sargs.sample_names = (optarg); sargs.subsample = true; break;
         case 'S': sargs.sample_names = (optarg); sargs.subsample = true; sargs.sample_is_file = 1; break;
@@ -789,6 +1114,38 @@ int pca_main(int argc,char **argv)
 	    else {cerr << "Unknown argument:"; exit(1);}
         }
     }
+    if(!panel_filename.empty())
+    {
+	if(weight_filename.empty())
+	{
+	    die("--build-panel requires the weights VCF (-W)");
+	}
+	build_pca_panel(weight_filename,panel_filename);
+	return(0);
+    }
+
+    if(batch)
+    {
+	if(!PcaPanel::is_panel_file(weight_filename))
+	{
+	    die("--batch/--socket require a panel compiled with --build-panel (-W)");
+	}
+	if(optind<argc-1)
+	{
+	    die("--batch/--socket read their inputs from stdin or the socket, not the command line");
+	}
+	omp_set_num_threads(nthreads < 1 ? 1 : nthreads);
+	RunStats stats;
+	stats.open("pca",stats_json);
+	VectorXf sv;
+	if(!svfilename.empty())
+	{
+	    sv = read_singular_values(svfilename);
+	}
+	pca_batch(weight_filename,socket_path, don, n, sargs,assume_homref,sv,stats);
+	return(0);
+    }
+
     if(!force  && targets.empty() && regions.empty() && weight_filename.empty())
     {
 	die("None of -t/-r/-T/-R/-W were provided.\n       kin does not require a dense set of markers and this can substantially increase compute time.\n       You can disable this error with --force");
@@ -809,18 +1166,54 @@ int pca_main(int argc,char **argv)
 	die("-t/-T and -r/-R cannot be used simultaneously");
     }
 
+    if(o && covn >= 2)
+    {
+	die("-C 2 decomposes a sample by sample matrix, so there are no marker loadings for -o");
+    }
+
+    if(packed && (a || covn >= 2))
+    {
+	die("--packed only works with the randomised SVD of -C 0 or -C 1");
+    }
+
+    if(nthreads < 1)
+    { 
+	nthreads = 1; 
+    }
+    omp_set_num_threads(nthreads);
+    if(nthreads > 1)
+    {
+	cerr << "Using " << nthreads << " threads" << endl;
+    }
+
     optind++;
     string input = argv[optind];
     cerr <<"Input: " << input << endl; 
+    RunStats stats;
+    stats.open("pca",stats_json);
+    stats.set("threads",nthreads);
     if(w)
     { 
 	cerr << "Using file " << weight_filename << " for PCA weights" << endl; 
-	pca(input,weight_filename, don, n, sargs,assume_homref);
+	VectorXf sv;///reference singular values for the shrinkage correction
+	if(!svfilename.empty())
+	{
+	    cerr << "Correcting projections for shrinkage with the singular values in " << svfilename << endl;
+	    sv = read_singular_values(svfilename);
+	}
+	if(PcaPanel::is_panel_file(weight_filename))
+	{
+	    pca_panel(input,weight_filename, don, n, sargs,assume_homref,sv,stats);
+	}
+	else
+	{
+	    pca(input,weight_filename, don, n, sargs,assume_homref,sv,stats);
+	}
     }
     else
     {
 	cerr << "MAF lower bound: " << m << "\nThin: "<< thin <<" \nNumber principle components: "<<n<<endl;
-	calcpca(input,o,outf,out_filename,m,thin,a,n,e,targets,regions,regions_is_file,sargs, covn, svfilename,niteration);
+	calcpca(input,o,outf,out_filename,m,thin,a,n,e,targets,regions,regions_is_file,sargs, covn, svfilename,niteration,packed,stats);
     }
 
 
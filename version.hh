@@ -0,0 +1,2 @@
+#define AKT_VERSION "3ebba82"
+#define BCFTOOLS_VERSION "1.6"